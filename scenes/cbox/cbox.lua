@@ -1,6 +1,7 @@
 local function matte(r, g, b)
     shaderGroupBegin()
 	parameter("color Cs", {r, g, b})
+	parameter("string userdata", "Cs")
     shader("surface", "matte", "layer1")
     shaderGroupEnd();
 end
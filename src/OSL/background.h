@@ -2,51 +2,49 @@
 
 #include "OSL/dual_vec.h"
 #include "OSL/oslconfig.h"
-#include <algorithm> // upper_bound
+#include <core/aliastable.hpp>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <atomic>
 
 OSL_NAMESPACE_ENTER
 
 struct Background {
-    Background() : values(0), rows(0), cols(0) {}
-    ~Background() {
-        delete [] values;
-        delete [] rows;
-        delete [] cols;
-    }
+    Background() : res(0), invres(0), invjacobian(0) {}
 
+    // evaluates cb(dir, data, thread) once per texel on the given number of
+    // threads, the callback must be safe to call concurrently for different
+    // thread indices
     template <typename F, typename T>
-    void prepare(int resolution, F cb, T* data) {
+    void prepare(int resolution, int threads, F cb, T* data) {
         res = resolution;
         if (res < 32) res = 32; // validate
         invres = 1.0f / res;
         invjacobian = res * res / float(4 * M_PI);
-        values = new Vec3[res * res];
-        rows   = new float[res];
-        cols   = new float[res * res];
-        for (int y = 0, i = 0; y < res; y++) {
-            for (int x = 0; x < res; x++, i++) {
-                values[i] = cb(map(x + 0.5f, y + 0.5f), data);
-                cols[i] = std::max(std::max(values[i].x, values[i].y), values[i].z) + ((x > 0) ? cols[i - 1] : 0.0f);
-            }
-            rows[y] = cols[i - 1] + ((y > 0) ? rows[y - 1] : 0.0f);
-            // normalize the pdf for this scanline (if it was non-zero)
-            if (cols[i - 1] > 0)
-                for (int x = 0; x < res; x++)
-                    cols[i - res + x] /= cols[i - 1];
-        }
-        // normalize the pdf across all scanlines
-        for (int y = 0; y < res; y++)
-            rows[y] /= rows[res - 1];
+        values.resize(res * res);
+
+        // rows are handed out one at a time, so that threads finish together
+        std::atomic<int> nextRow(0);
+        std::vector<std::thread> workers;
+        for (int t = 1; t < threads; t++)
+            workers.push_back(std::thread(&Background::prepareRows<F, T>, this, cb, data, t, &nextRow));
+        prepareRows(cb, data, 0, &nextRow);
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
 
-        // both eval and sample below return a "weight" that is
-        // value[i] / row*col_pdf, so might as well bake it into the table
-        for (int y = 0, i = 0; y < res; y++) {
-            float row_pdf = rows[y] - (y > 0 ? rows[y - 1] : 0.0f);
-            for (int x = 0; x < res; x++, i++) {
-                float col_pdf = cols[i] - (x > 0 ? cols[i - 1] : 0.0f);
-                values[i] /= row_pdf * col_pdf * invjacobian;
-            }
+        std::vector<float> weights(res * res);
+        double sum = 0;
+        for (int i = 0; i < res * res; i++) {
+            weights[i] = std::max(std::max(values[i].x, values[i].y), values[i].z);
+            sum += weights[i];
         }
+        // the texels are point samples of the background, so a texel that
+        // missed a small bright feature keeps a small chance to be picked
+        float lowest = float(sum / (res * res)) * 1e-3f;
+        for (int i = 0; i < res * res; i++)
+            weights[i] = std::max(weights[i], lowest);
+        table.build(&weights[0], res * res);
 #if 0  // DEBUG: visualize importance table
         using namespace OIIO;
         ImageOutput* out = ImageOutput::create("bg.exr");
@@ -57,6 +55,7 @@ struct Background {
 #endif
     }
 
+    // returns the tabulated radiance in the direction
     Vec3 eval(const Vec3& dir, float& pdf) const {
         // map from sphere to unit-square
         float u = OIIO::fast_atan2(dir.y, dir.x) * float(M_1_PI * 0.5f);
@@ -66,23 +65,30 @@ struct Background {
         int x = (int) (u * res); if (x < 0) x = 0; else if (x >= res) x = res - 1;
         int y = (int) (v * res); if (y < 0) y = 0; else if (y >= res) y = res - 1;
         int i = y * res + x;
-        float row_pdf = rows[y] - (y > 0 ? rows[y - 1] : 0.0f);
-        float col_pdf = cols[i] - (x > 0 ? cols[i - 1] : 0.0f);
-        pdf = row_pdf * col_pdf * invjacobian;
+        pdf = table.pdf(i) * invjacobian;
         return values[i];
     }
 
+    // picks a texel from the alias table, rx is reused for the position
+    // within the texel. returns the tabulated radiance in the direction.
     Vec3 sample(float rx, float ry, Dual2<Vec3>& dir, float& pdf) const {
-        float row_pdf, col_pdf;
-        unsigned x, y;
-        ry = sample_cdf(rows, res, ry, &y, &row_pdf);
-        rx = sample_cdf(cols + y * res, res, rx, &x, &col_pdf);
+        float texel_pdf;
+        int i = table.sample(rx, &texel_pdf, &rx);
+        int x = i % res;
+        int y = i / res;
         dir = map(x + rx, y + ry);
-        pdf = row_pdf * col_pdf * invjacobian;
-        return values[y * res + x];
+        pdf = texel_pdf * invjacobian;
+        return values[i];
     }
 
 private:
+    template <typename F, typename T>
+    void prepareRows(F cb, T* data, int thread, std::atomic<int>* nextRow) {
+        for (int y = (*nextRow)++; y < res; y = (*nextRow)++)
+            for (int x = 0; x < res; x++)
+                values[y * res + x] = cb(map(x + 0.5f, y + 0.5f), data, thread);
+    }
+
     Dual2<Vec3> map(float x, float y) const {
         // pixel coordinates of entry (x,y)
         Dual2<float> u = Dual2<float>(x, 1, 0) * invres;
@@ -97,28 +103,8 @@ private:
                          cos_phi);
     }
 
-    static float sample_cdf(const float* data, unsigned int n, float x, unsigned int *idx, float* pdf) {
-        DASSERT(x >= 0);
-        DASSERT(x < 1);
-        *idx = std::upper_bound(data, data + n, x) - data;
-        DASSERT(*idx < n);
-        DASSERT(x < data[*idx]);
-        float scaled_sample;
-        if (*idx == 0) {
-            *pdf = data[0];
-            scaled_sample = x / data[0];
-        } else {
-            DASSERT(x >= data[*idx - 1]);
-            *pdf = data[*idx] - data[*idx - 1];
-            scaled_sample = (x - data[*idx - 1]) / (data[*idx] - data[*idx - 1]);
-        }
-        // keep result in [0,1)
-        return std::min(scaled_sample, 0.99999994f);
-    }
-
-    Vec3*  values;  // actual map
-    float* rows;    // probability of choosing a given row 'y'
-    float* cols;    // probability of choosing a given column 'x', given that we've chosen row 'y'
+    std::vector<Vec3> values;           // actual map
+    paprika::core::AliasTable table;    // probability of choosing a given texel
     int res;        // resolution in pixels of the precomputed table
     float invres;   // 1 / resolution
     float invjacobian;
@@ -98,14 +98,21 @@ OSL_NAMESPACE_EXIT
 
 namespace { // anonymous namespace
 
+/// Common base of the lobes, which are dispatched on their BSDFType rather
+/// than through virtual calls, so that the calls can be inlined
+struct BSDF {
+    BSDF() {}
+    float albedo(const ShaderGlobals& sg) const { return 1; }
+};
+
 template <int trans>
 struct Diffuse : public BSDF, DiffuseParams {
     Diffuse(const DiffuseParams& params) : BSDF(), DiffuseParams(params) { if (trans) N = -N; }
-    virtual float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
+    float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
         pdf = std::max(N.dot(wi), 0.0f) * float(M_1_PI);
         return 1.0f;
     }
-    virtual float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
+    float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
         Vec3 out_dir;
         Sampling::sample_cosine_hemisphere(N, rx, ry, out_dir, pdf);
         wi = out_dir; // FIXME: leave derivs 0?
@@ -120,7 +127,7 @@ struct OrenNayar : public BSDF, OrenNayarParams {
       A = 1 - 0.50f * s2 / (s2 + 0.33f);
       B =     0.45f * s2 / (s2 + 0.09f);
    }
-   virtual float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
+   float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
       float NL =  N.dot(wi);
       float NV = -N.dot(sg.I);
       if (NL > 0 && NV > 0) {
@@ -138,7 +145,7 @@ struct OrenNayar : public BSDF, OrenNayarParams {
       }
       return pdf = 0;
    }
-   virtual float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
+   float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
        Vec3 out_dir;
        Sampling::sample_cosine_hemisphere(N, rx, ry, out_dir, pdf);
        wi = out_dir; // leave derivs 0?
@@ -158,7 +165,7 @@ private:
 
 struct Phong : public BSDF, PhongParams {
     Phong(const PhongParams& params) : BSDF(), PhongParams(params) {}
-    virtual float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
+    float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
         float cosNI =  N.dot(wi);
         float cosNO = -N.dot(sg.I);
         if (cosNI > 0 && cosNO > 0) {
@@ -172,7 +179,7 @@ struct Phong : public BSDF, PhongParams {
         }
         return pdf = 0;
     }
-    virtual float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
+    float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
         float cosNO = -N.dot(sg.I);
         if (cosNO > 0) {
             // reflect the view vector
@@ -199,7 +206,7 @@ struct Phong : public BSDF, PhongParams {
 
 struct Ward : public BSDF, WardParams {
     Ward(const WardParams& params) : BSDF(), WardParams(params) {}
-    virtual float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
+    float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
         float cosNO = -N.dot(sg.I);
         float cosNI =  N.dot(wi);
         if (cosNI > 0 && cosNO > 0) {
@@ -220,7 +227,7 @@ struct Ward : public BSDF, WardParams {
         }
         return 0;
     }
-    virtual float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
+    float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
         float cosNO = -N.dot(sg.I);
         if (cosNO > 0) {
             // get x,y basis on the surface for anisotropy
@@ -385,14 +392,14 @@ struct Microfacet : public BSDF, MicrofacetParams {
     Microfacet(const MicrofacetParams& params) : BSDF(),
         MicrofacetParams(params),
         tf(U == Vec3(0) || xalpha == yalpha ? TangentFrame(N) : TangentFrame(N, U)) { }
-    virtual float albedo(const ShaderGlobals& sg) const {
+    float albedo(const ShaderGlobals& sg) const {
         if (Refract == 2) return 1.0f;
         // FIXME: this heuristic is not particularly good, and looses energy
         // compared to the reference solution
         float fr = fresnel_dielectric(-N.dot(sg.I), eta);
         return Refract ? 1 - fr : fr;
     }
-    virtual float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
+    float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
         Vec3 wo = -sg.I;
     	const Vec3 wo_l = tf.tolocal(wo);
     	const Vec3 wi_l = tf.tolocal(wi);
@@ -455,7 +462,7 @@ struct Microfacet : public BSDF, MicrofacetParams {
         return pdf = 0;
     }
 
-    virtual float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
+    float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
     	const Vec3 wo_l = tf.tolocal(-sg.I);
     	const float cosNO = wo_l.z;
     	if (!(cosNO > 0)) return pdf = 0;
@@ -593,16 +600,16 @@ typedef Microfacet<BeckmannDist, 2> MicrofacetBeckmannBoth;
 
 struct Reflection : public BSDF, ReflectionParams {
     Reflection(const ReflectionParams& params) : BSDF(), ReflectionParams(params) {}
-    virtual float albedo(const ShaderGlobals& sg) const {
+    float albedo(const ShaderGlobals& sg) const {
         float cosNO = -N.dot(sg.I);
         if (cosNO > 0)
             return fresnel_dielectric(cosNO, eta);
         return 1;
     }
-    virtual float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
+    float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
         return pdf = 0;
     }
-    virtual float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
+    float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
         // only one direction is possible
         OSL::Dual2<OSL::Vec3> I = OSL::Dual2<OSL::Vec3>(sg.I, sg.dIdx, sg.dIdy);
         OSL::Dual2<float> cosNO = -dot(N, I);
@@ -617,14 +624,14 @@ struct Reflection : public BSDF, ReflectionParams {
 
 struct Refraction : public BSDF, RefractionParams {
     Refraction(const RefractionParams& params) : BSDF(), RefractionParams(params) {}
-    virtual float albedo(const ShaderGlobals& sg) const {
+    float albedo(const ShaderGlobals& sg) const {
         float cosNO = -N.dot(sg.I);
         return 1 - fresnel_dielectric(cosNO, eta);
     }
-    virtual float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
+    float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
         return pdf = 0;
     }
-    virtual float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
+    float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
         OSL::Dual2<OSL::Vec3> I = OSL::Dual2<OSL::Vec3>(sg.I, sg.dIdx, sg.dIdy);
         pdf = std::numeric_limits<float>::infinity();
         return fresnel_refraction(I, N, eta, wi);
@@ -633,10 +640,10 @@ struct Refraction : public BSDF, RefractionParams {
 
 struct Transparent : public BSDF {
     Transparent(const int& dummy) : BSDF() {}
-    virtual float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
+    float eval  (const OSL::ShaderGlobals& sg, const OSL::Vec3& wi, float& pdf) const {
         return pdf = 0;
     }
-    virtual float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
+    float sample(const OSL::ShaderGlobals& sg, float rx, float ry, float rz, OSL::Dual2<OSL::Vec3>& wi, float& pdf) const {
         wi = OSL::Dual2<OSL::Vec3>(sg.I, sg.dIdx, sg.dIdy);
         pdf = std::numeric_limits<float>::infinity();
         return 1;
@@ -644,6 +651,55 @@ struct Transparent : public BSDF {
 };
 
 
+// calls the visitor with the lobe cast to its concrete type
+template <typename Visitor>
+typename Visitor::result_type visit_bsdf(int type, const void* lobe, const Visitor& v) {
+    switch (type) {
+        case BSDF_DIFFUSE:                  return v(*static_cast<const Diffuse<0>*            >(lobe));
+        case BSDF_TRANSLUCENT:              return v(*static_cast<const Diffuse<1>*            >(lobe));
+        case BSDF_OREN_NAYAR:               return v(*static_cast<const OrenNayar*             >(lobe));
+        case BSDF_PHONG:                    return v(*static_cast<const Phong*                 >(lobe));
+        case BSDF_WARD:                     return v(*static_cast<const Ward*                  >(lobe));
+        case BSDF_MICROFACET_GGX_REFL:      return v(*static_cast<const MicrofacetGGXRefl*     >(lobe));
+        case BSDF_MICROFACET_GGX_REFR:      return v(*static_cast<const MicrofacetGGXRefr*     >(lobe));
+        case BSDF_MICROFACET_GGX_BOTH:      return v(*static_cast<const MicrofacetGGXBoth*     >(lobe));
+        case BSDF_MICROFACET_BECKMANN_REFL: return v(*static_cast<const MicrofacetBeckmannRefl*>(lobe));
+        case BSDF_MICROFACET_BECKMANN_REFR: return v(*static_cast<const MicrofacetBeckmannRefr*>(lobe));
+        case BSDF_MICROFACET_BECKMANN_BOTH: return v(*static_cast<const MicrofacetBeckmannBoth*>(lobe));
+        case BSDF_REFLECTION:               return v(*static_cast<const Reflection*            >(lobe));
+        case BSDF_REFRACTION:               return v(*static_cast<const Refraction*            >(lobe));
+        case BSDF_TRANSPARENT:              return v(*static_cast<const Transparent*           >(lobe));
+    }
+    ASSERT(false && "Invalid bsdf type");
+    return typename Visitor::result_type();
+}
+
+struct AlbedoVisitor {
+    typedef float result_type;
+    AlbedoVisitor(const ShaderGlobals& sg) : sg(sg) {}
+    template <typename Lobe> float operator()(const Lobe& lobe) const { return lobe.albedo(sg); }
+    const ShaderGlobals& sg;
+};
+
+struct EvalVisitor {
+    typedef float result_type;
+    EvalVisitor(const ShaderGlobals& sg, const Vec3& wi, float& pdf) : sg(sg), wi(wi), pdf(pdf) {}
+    template <typename Lobe> float operator()(const Lobe& lobe) const { return lobe.eval(sg, wi, pdf); }
+    const ShaderGlobals& sg;
+    const Vec3& wi;
+    float& pdf;
+};
+
+struct SampleVisitor {
+    typedef float result_type;
+    SampleVisitor(const ShaderGlobals& sg, float rx, float ry, float rz, Dual2<Vec3>& wi, float& pdf) : sg(sg), rx(rx), ry(ry), rz(rz), wi(wi), pdf(pdf) {}
+    template <typename Lobe> float operator()(const Lobe& lobe) const { return lobe.sample(sg, rx, ry, rz, wi, pdf); }
+    const ShaderGlobals& sg;
+    float rx, ry, rz;
+    Dual2<Vec3>& wi;
+    float& pdf;
+};
+
 // recursively walk through the closure tree, creating bsdfs as we go
 void process_closure (ShadingResult& result, const ClosureColor* closure, const Color3& w, bool light_only) {
    static const ustring u_ggx("ggx");
@@ -670,32 +726,32 @@ void process_closure (ShadingResult& result, const ClosureColor* closure, const
            else if (!light_only) {
                bool ok = false;
                switch (comp->id) {
-                   case DIFFUSE_ID:            ok = result.bsdf.add_bsdf<Diffuse<0>, DiffuseParams   >(cw, *comp->as<DiffuseParams>  ()); break;
-                   case OREN_NAYAR_ID:         ok = result.bsdf.add_bsdf<OrenNayar , OrenNayarParams >(cw, *comp->as<OrenNayarParams>()); break;
-                   case TRANSLUCENT_ID:        ok = result.bsdf.add_bsdf<Diffuse<1>, DiffuseParams   >(cw, *comp->as<DiffuseParams>  ()); break;
-                   case PHONG_ID:              ok = result.bsdf.add_bsdf<Phong     , PhongParams     >(cw, *comp->as<PhongParams>    ()); break;
-                   case WARD_ID:               ok = result.bsdf.add_bsdf<Ward      , WardParams      >(cw, *comp->as<WardParams>     ()); break;
+                   case DIFFUSE_ID:            ok = result.bsdf.add_bsdf<Diffuse<0>, DiffuseParams   >(BSDF_DIFFUSE, cw, *comp->as<DiffuseParams>  ()); break;
+                   case OREN_NAYAR_ID:         ok = result.bsdf.add_bsdf<OrenNayar , OrenNayarParams >(BSDF_OREN_NAYAR, cw, *comp->as<OrenNayarParams>()); break;
+                   case TRANSLUCENT_ID:        ok = result.bsdf.add_bsdf<Diffuse<1>, DiffuseParams   >(BSDF_TRANSLUCENT, cw, *comp->as<DiffuseParams>  ()); break;
+                   case PHONG_ID:              ok = result.bsdf.add_bsdf<Phong     , PhongParams     >(BSDF_PHONG, cw, *comp->as<PhongParams>    ()); break;
+                   case WARD_ID:               ok = result.bsdf.add_bsdf<Ward      , WardParams      >(BSDF_WARD, cw, *comp->as<WardParams>     ()); break;
                    case MICROFACET_ID: {
                        const MicrofacetParams* mp = comp->as<MicrofacetParams>();
                        if (mp->dist == u_ggx) {
                            switch (mp->refract) {
-                               case 0: ok = result.bsdf.add_bsdf<MicrofacetGGXRefl, MicrofacetParams>(cw, *mp); break;
-                               case 1: ok = result.bsdf.add_bsdf<MicrofacetGGXRefr, MicrofacetParams>(cw, *mp); break;
-                               case 2: ok = result.bsdf.add_bsdf<MicrofacetGGXBoth, MicrofacetParams>(cw, *mp); break;
+                               case 0: ok = result.bsdf.add_bsdf<MicrofacetGGXRefl, MicrofacetParams>(BSDF_MICROFACET_GGX_REFL, cw, *mp); break;
+                               case 1: ok = result.bsdf.add_bsdf<MicrofacetGGXRefr, MicrofacetParams>(BSDF_MICROFACET_GGX_REFR, cw, *mp); break;
+                               case 2: ok = result.bsdf.add_bsdf<MicrofacetGGXBoth, MicrofacetParams>(BSDF_MICROFACET_GGX_BOTH, cw, *mp); break;
                            }
                        } else if (mp->dist == u_beckmann || mp->dist == u_default) {
                            switch (mp->refract) {
-                               case 0: ok = result.bsdf.add_bsdf<MicrofacetBeckmannRefl, MicrofacetParams>(cw, *mp); break;
-                               case 1: ok = result.bsdf.add_bsdf<MicrofacetBeckmannRefr, MicrofacetParams>(cw, *mp); break;
-                               case 2: ok = result.bsdf.add_bsdf<MicrofacetBeckmannBoth, MicrofacetParams>(cw, *mp); break;
+                               case 0: ok = result.bsdf.add_bsdf<MicrofacetBeckmannRefl, MicrofacetParams>(BSDF_MICROFACET_BECKMANN_REFL, cw, *mp); break;
+                               case 1: ok = result.bsdf.add_bsdf<MicrofacetBeckmannRefr, MicrofacetParams>(BSDF_MICROFACET_BECKMANN_REFR, cw, *mp); break;
+                               case 2: ok = result.bsdf.add_bsdf<MicrofacetBeckmannBoth, MicrofacetParams>(BSDF_MICROFACET_BECKMANN_BOTH, cw, *mp); break;
                            }
                        }
                        break;
                    }
                    case REFLECTION_ID:
-                   case FRESNEL_REFLECTION_ID: ok = result.bsdf.add_bsdf<Reflection , ReflectionParams>(cw, *comp->as<ReflectionParams>()); break;
-                   case REFRACTION_ID:         ok = result.bsdf.add_bsdf<Refraction , RefractionParams>(cw, *comp->as<RefractionParams>()); break;
-                   case TRANSPARENT_ID:        ok = result.bsdf.add_bsdf<Transparent, int             >(cw, 0); break;
+                   case FRESNEL_REFLECTION_ID: ok = result.bsdf.add_bsdf<Reflection , ReflectionParams>(BSDF_REFLECTION, cw, *comp->as<ReflectionParams>()); break;
+                   case REFRACTION_ID:         ok = result.bsdf.add_bsdf<Refraction , RefractionParams>(BSDF_REFRACTION, cw, *comp->as<RefractionParams>()); break;
+                   case TRANSPARENT_ID:        ok = result.bsdf.add_bsdf<Transparent, int             >(BSDF_TRANSPARENT, cw, 0); break;
                }
                ASSERT(ok && "Invalid closure invoked in surface shader");
            }
@@ -708,6 +764,62 @@ void process_closure (ShadingResult& result, const ClosureColor* closure, const
 
 OSL_NAMESPACE_ENTER
 
+void CompositeBSDF::prepare(const ShaderGlobals& sg, const Color3& path_weight, bool absorb) {
+    float w = 1 / (path_weight.x + path_weight.y + path_weight.z);
+    float total = 0;
+    for (int i = 0; i < num_bsdfs; i++) {
+        pdfs[i] = weights[i].dot(path_weight) * visit_bsdf(types[i], pool + offsets[i], AlbedoVisitor(sg)) * w;
+        total += pdfs[i];
+    }
+    if ((!absorb && total > 0) || total > 1) {
+        for (int i = 0; i < num_bsdfs; i++)
+            pdfs[i] /= total;
+    }
+}
+
+void CompositeBSDF::eval_lobes(const ShaderGlobals& sg, const Vec3& wi, int skip, Color3& f, float& pdf) const {
+    float lobe_f[MaxEntries], lobe_pdf[MaxEntries];
+    for (int i = 0; i < num_bsdfs; i++) {
+        lobe_pdf[i] = 0;
+        lobe_f[i] = i != skip ? visit_bsdf(types[i], pool + offsets[i], EvalVisitor(sg, wi, lobe_pdf[i])) : 0.0f;
+    }
+    // the balance heuristic over the lobes reduces to sums of f * cos and
+    // of the pdfs. lobes that are never picked don't count, like in
+    // MIS::update_eval
+    for (int i = 0; i < num_bsdfs; i++) {
+        float picked = pdfs[i] > std::numeric_limits<float>::min() ? 1.0f : 0.0f;
+        f   += weights[i] * (lobe_f[i] * lobe_pdf[i] * picked);
+        pdf += lobe_pdf[i] * pdfs[i];
+    }
+}
+
+Color3 CompositeBSDF::eval(const ShaderGlobals& sg, const Vec3& wi, float& pdf) const {
+    Color3 f(0, 0, 0); pdf = 0;
+    eval_lobes(sg, wi, -1, f, pdf);
+    return pdf > 0 ? f / pdf : Color3(0, 0, 0);
+}
+
+Color3 CompositeBSDF::sample(const ShaderGlobals& sg, float rx, float ry, float rz, Dual2<Vec3>& wi, float& pdf) const {
+    float accum = 0;
+    for (int i = 0; i < num_bsdfs; i++) {
+        if (rx < (pdfs[i] + accum)) {
+            rx = (rx - accum) / pdfs[i];
+            rx = std::min(rx, 0.99999994f); // keep result in [0,1)
+            Color3 result = weights[i] * (visit_bsdf(types[i], pool + offsets[i], SampleVisitor(sg, rx, ry, rz, wi, pdf)) / pdfs[i]);
+            pdf *= pdfs[i];
+            // a specular direction has no density to share with the others
+            if (!(pdf > 0) || pdf == std::numeric_limits<float>::infinity())
+                return result;
+            // we sampled PDF i, now figure out how much the other bsdfs contribute to the chosen direction
+            Color3 f = result * pdf;
+            eval_lobes(sg, wi.val(), i, f, pdf);
+            return f / pdf;
+        }
+        accum += pdfs[i];
+    }
+    return Color3(0, 0, 0);
+}
+
 void process_closure(ShadingResult& result, const ClosureColor* Ci, bool light_only) {
     ::process_closure(result, Ci, Color3(1, 1, 1), light_only);
 }
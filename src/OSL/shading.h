@@ -9,90 +9,74 @@
 
 OSL_NAMESPACE_ENTER
 
-/// Individual BSDF (diffuse, phong, refraction, etc ...)
-/// Actual implementations of this class are private
-struct BSDF {
-    BSDF() {}
-    virtual float albedo(const ShaderGlobals& sg) const { return 1; }
-    virtual float eval  (const ShaderGlobals& sg, const Vec3& wi, float& pdf) const = 0;
-    virtual float sample(const ShaderGlobals& sg, float rx, float ry, float rz, Dual2<Vec3>& wi, float& pdf) const = 0;
+/// Kinds of lobe a CompositeBSDF can hold. The lobes themselves are private
+/// to shading.cpp and are dispatched with a switch on their type.
+enum BSDFType {
+    BSDF_DIFFUSE,
+    BSDF_TRANSLUCENT,
+    BSDF_OREN_NAYAR,
+    BSDF_PHONG,
+    BSDF_WARD,
+    BSDF_MICROFACET_GGX_REFL,
+    BSDF_MICROFACET_GGX_REFR,
+    BSDF_MICROFACET_GGX_BOTH,
+    BSDF_MICROFACET_BECKMANN_REFL,
+    BSDF_MICROFACET_BECKMANN_REFR,
+    BSDF_MICROFACET_BECKMANN_BOTH,
+    BSDF_REFLECTION,
+    BSDF_REFRACTION,
+    BSDF_TRANSPARENT
 };
 
 /// Represents a weighted sum of BSDFS
-/// NOTE: no need to inherit from BSDF here because we use a "flattened" representation and therefore never nest these
+/// NOTE: the lobes are stored by value with their type, so the struct has no
+/// pointers into itself
 ///
 struct CompositeBSDF {
     CompositeBSDF() : num_bsdfs(0), num_bytes(0) {}
 
-    void prepare(const ShaderGlobals& sg, const Color3& path_weight, bool absorb) {
-        float w = 1 / (path_weight.x + path_weight.y + path_weight.z);
-        float total = 0;
-        for (int i = 0; i < num_bsdfs; i++) {
-            pdfs[i] = weights[i].dot(path_weight) * bsdfs[i]->albedo(sg) * w;
-            total += pdfs[i];
-        }
-        if ((!absorb && total > 0) || total > 1) {
-            for (int i = 0; i < num_bsdfs; i++)
-                pdfs[i] /= total;
-        }
-    }
+    void prepare(const ShaderGlobals& sg, const Color3& path_weight, bool absorb);
 
-    Color3 eval  (const ShaderGlobals& sg, const Vec3& wi, float& pdf) const {
-        Color3 result(0, 0, 0); pdf = 0;
-        for (int i = 0; i < num_bsdfs; i++) {
-            float bsdf_pdf = 0;
-            Color3 bsdf_weight = weights[i] * bsdfs[i]->eval(sg, wi, bsdf_pdf);
-            MIS::update_eval(&result, &pdf, bsdf_weight, bsdf_pdf, pdfs[i]);
-        }
-        return result;
-    }
+    /// Returns the weight f * cos / pdf of the mixture towards wi along with
+    /// its pdf, so f * cos is the result times the pdf
+    Color3 eval  (const ShaderGlobals& sg, const Vec3& wi, float& pdf) const;
 
-    Color3 sample(const ShaderGlobals& sg, float rx, float ry, float rz, Dual2<Vec3>& wi, float& pdf) const {
-        float accum = 0;
-        for (int i = 0; i < num_bsdfs; i++) {
-            if (rx < (pdfs[i] + accum)) {
-                rx = (rx - accum) / pdfs[i];
-                rx = std::min(rx, 0.99999994f); // keep result in [0,1)
-                Color3 result = weights[i] * (bsdfs[i]->sample(sg, rx, ry, rz, wi, pdf) / pdfs[i]);
-                pdf *= pdfs[i];
-                // we sampled PDF i, now figure out how much the other bsdfs contribute to the chosen direction
-                for (int j = 0; j < num_bsdfs; j++) {
-                    if (i == j) continue;
-                    float bsdf_pdf = 0;
-                    Color3 bsdf_weight = weights[j] * bsdfs[j]->eval(sg, wi.val(), bsdf_pdf);
-		            MIS::update_eval(&result, &pdf, bsdf_weight, bsdf_pdf, pdfs[j]);
-                }
-                return result;
-            }
-            accum += pdfs[i];
-        }
-        return Color3(0, 0, 0);
-    }
+    /// Picks a lobe with rx and samples it, returns the weight of the
+    /// mixture in the sampled direction
+    Color3 sample(const ShaderGlobals& sg, float rx, float ry, float rz, Dual2<Vec3>& wi, float& pdf) const;
 
     template <typename BSDF_Type, typename BSDF_Params>
-    bool add_bsdf(const Color3& w, const BSDF_Params& params) {
-        // make sure we have enough space
+    bool add_bsdf(BSDFType type, const Color3& w, const BSDF_Params& params) {
+        // make sure we have enough space, lobes start on 16 byte boundaries
+        size_t size = (sizeof(BSDF_Type) + 15) & ~size_t(15);
         if (num_bsdfs >= MaxEntries) return false;
-        if (num_bytes + sizeof(BSDF_Type) > MaxSize) return false;
+        if (num_bytes + size > MaxSize) return false;
         weights[num_bsdfs] = w;
-        bsdfs  [num_bsdfs] = new (pool + num_bytes) BSDF_Type(params);
+        types  [num_bsdfs] = (unsigned char)type;
+        offsets[num_bsdfs] = (unsigned short)num_bytes;
+        new (pool + num_bytes) BSDF_Type(params);
         num_bsdfs++;
-        num_bytes += sizeof(BSDF_Type);
+        num_bytes += size;
         return true;
     }
 
 private:
-    /// Never try to copy this struct because it would invalidate the bsdf pointers
+    /// Results are built in place, copying the pool is a waste of time
     CompositeBSDF(const CompositeBSDF& c);
     CompositeBSDF& operator=(const CompositeBSDF& c);
 
+    /// Evaluates every lobe except skip towards wi, then sums them in a
+    /// separate pass without branches
+    void eval_lobes(const ShaderGlobals& sg, const Vec3& wi, int skip, Color3& f, float& pdf) const;
+
     enum { MaxEntries = 8 };
     enum { MaxSize = 256 * sizeof(float) };
 
     Color3 weights[MaxEntries];
     float  pdfs[MaxEntries];
-    BSDF*  bsdfs[MaxEntries];
-    char   pool[MaxSize];
+    unsigned char  types[MaxEntries];
+    unsigned short offsets[MaxEntries];
+    alignas(16) char pool[MaxSize];
     int    num_bsdfs, num_bytes;
 };
 
@@ -6,13 +6,27 @@
 #include <shapes/mesh.hpp>
 #include <core/primitive.hpp>
 #include <cameras/perspectivecamera.hpp>
+#include <lights/environmentlight.hpp>
+#include <samplers/independentsampler.hpp>
+#include <samplers/sobolsampler.hpp>
+#include <samplers/pmj02sampler.hpp>
 #include <core/scene.hpp>
 #include <core/renderer.hpp>
+#include <core/debug.hpp>
 #include <stack>
+#include <sstream>
+#include <set>
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <OpenImageIO/timer.h>
+#include <OpenImageIO/texture.h>
 #include <OSL/oslexec.h>
 #include <OSL/shading.h>
 #include <shapes/sphere.hpp>
 #include <renderers/pathtracer.hpp>
+#include <renderers/wavefrontpathtracer.hpp>
 #include <renderers/debugrenderer.hpp>
 #include <generators/luagenerator.hpp>
 #include <generators/trimeshgenerator.hpp>
@@ -26,6 +40,16 @@ enum APIState
     STATE_SHADER,
 };
 
+// shader parameter bound per primitive instead of in the shader group,
+// its value from the shader() call is given to the primitives of the group
+// that don't set it themselves
+struct GeometryParam
+{
+    OIIO::ustring name;
+    core::ParamType type;
+    std::vector<char> data;
+};
+
 struct PaprikaAPI::PaprikaData
 {	
     APIState state;
@@ -37,17 +61,24 @@ struct PaprikaAPI::PaprikaData
     core::RendererService rendererService;
     RTCDevice rtcDevice;
     OSL::ErrorHandler errorHandler;
+    OIIO::TextureSystem *textureSystem;
     OSL::ShadingSystem *shadingSystem;
     core::Transform shaderTransform;
     OSL::ShaderGroupRef shaderGroup;
     OSL::ShaderGroupRef backgroundShaderGroup;
+    light::EnvironmentLight *environmentLight;
+    std::string shaderGroupKey;                                     // layers, parameters and connections of the open group
+    std::map<std::string, OSL::ShaderGroupRef> shaderGroups;        // groups built so far, by key
+    std::vector<GeometryParam> shaderGroupParams;                   // per primitive parameters of the open group
+    std::vector<GeometryParam> geometryParams;                      // per primitive parameters of the current group
 };
 
 PaprikaAPI::PaprikaAPI()
 {
     d_ = new PaprikaData;
     d_->rtcDevice = rtcNewDevice(NULL);
-    d_->shadingSystem = new OSL::ShadingSystem(&d_->rendererService, NULL, &d_->errorHandler);
+    d_->textureSystem = OIIO::TextureSystem::create(true);
+    d_->shadingSystem = new OSL::ShadingSystem(&d_->rendererService, d_->textureSystem, &d_->errorHandler);
     register_closures(d_->shadingSystem);
     d_->shadingSystem->attribute("lockgeom", 1);
 #if 1
@@ -56,6 +87,7 @@ PaprikaAPI::PaprikaAPI()
 #endif
     d_->state = STATE_OPTIONS;
     d_->camera = NULL;
+    d_->environmentLight = NULL;
 }
 
 PaprikaAPI::~PaprikaAPI()
@@ -63,12 +95,17 @@ PaprikaAPI::~PaprikaAPI()
     if (d_->camera)
         d_->camera->unref();
 
+    if (d_->environmentLight)
+        d_->environmentLight->unref();
+
     for (std::size_t i = 0; i < d_->primitives.size(); ++i)
         d_->primitives[i]->unref();
 
     d_->backgroundShaderGroup = nullptr;
     d_->shaderGroup = nullptr;
+    d_->shaderGroups.clear();
     delete d_->shadingSystem;
+    OIIO::TextureSystem::destroy(d_->textureSystem);
 
     rtcDeleteDevice(d_->rtcDevice);
 
@@ -244,6 +281,23 @@ void PaprikaAPI::lookAt(float ex, float ey, float ez,
     d_->ctm = core::Transform::lookAt(ex, ey, ez, lx, ly, lz, ux, uy, uz) * d_->ctm;
 }
 
+// gives the primitive the per primitive shader parameters it doesn't set
+static void addGeometryParams(core::ParameterMap &params, const std::vector<GeometryParam> &geometryParams)
+{
+    for (std::size_t i = 0; i < geometryParams.size(); ++i)
+    {
+        const GeometryParam &param = geometryParams[i];
+        if (params.find(param.name.c_str()) != params.end())
+            continue;
+
+        // strings are never userdata, see shader()
+        if (param.type.type.basetype == OIIO::TypeDesc::INT)
+            params.parameter(param.name.c_str(), param.type, (const int*)&param.data[0]);
+        else
+            params.parameter(param.name.c_str(), param.type, (const float*)&param.data[0]);
+    }
+}
+
 //valid states
 //STATE_WORLD
 void PaprikaAPI::mesh(const char* interp, int nfaces, const int* nverts, const int* verts)
@@ -256,6 +310,8 @@ void PaprikaAPI::mesh(const char* interp, int nfaces, const int* nverts, const i
 
     bool isEmissive = d_->params.find("emissive", OIIO::TypeDesc::INT, 0);
 
+    addGeometryParams(d_->params, d_->geometryParams);
+
     shape::Mesh *mesh = new shape::Mesh(d_->rtcDevice, interp, nfaces, nverts, verts, d_->params);
     core::Primitive *primitive = new core::Primitive(mesh, d_->ctm, d_->shaderGroup, d_->shaderTransform, isEmissive);
     mesh->unref();
@@ -279,6 +335,8 @@ void PaprikaAPI::sphere(float radius)
 
     bool isEmissive = d_->params.find("emissive", OIIO::TypeDesc::INT, 0);
 
+    addGeometryParams(d_->params, d_->geometryParams);
+
     shape::Sphere *sphere = new shape::Sphere(d_->rtcDevice, radius, d_->params);
     core::Primitive *primitive = new core::Primitive(sphere, d_->ctm, d_->shaderGroup, d_->shaderTransform, isEmissive);
     sphere->unref();
@@ -297,7 +355,21 @@ void PaprikaAPI::background()
         return;
     }
 
-    d_->backgroundShaderGroup = d_->shaderGroup;
+    if (d_->environmentLight != NULL)
+    {
+        d_->environmentLight->unref();
+        d_->environmentLight = NULL;
+    }
+
+    // an environment map is looked up directly, otherwise the current shader
+    // group is run for escaping rays
+    if (d_->params.find("filename", OIIO::TypeDesc::STRING, (const char*)NULL) != NULL)
+    {
+        d_->environmentLight = light::EnvironmentLight::create(d_->ctm, d_->params);
+        d_->backgroundShaderGroup = nullptr;
+    }
+    else
+        d_->backgroundShaderGroup = d_->shaderGroup;
 
     d_->params.reportUnused("background");
     d_->params.clear();
@@ -330,6 +402,83 @@ void PaprikaAPI::world()
     d_->state = STATE_WORLD;
 }
 
+static void optimizeShaderGroups(OSL::ShadingSystem *shadingSystem, const std::vector<OSL::ShaderGroup*> &groups, std::vector<double> *times, std::atomic<int> *next)
+{
+    for (int i = (*next)++; i < (int)groups.size(); i = (*next)++)
+    {
+        OIIO::Timer timer;
+        shadingSystem->optimize_group(groups[i]);
+        (*times)[i] = timer();
+    }
+}
+
+// optimizes and compiles every shader group of the scene up front, so
+// that the first tiles don't stall on them one at a time
+static void prepareShaderGroups(OSL::ShadingSystem *shadingSystem, const std::vector<core::Primitive*> &primitives, OSL::ShaderGroupRef backgroundShaderGroup, int threads)
+{
+    std::vector<OSL::ShaderGroup*> groups;
+    std::set<OSL::ShaderGroup*> seen;
+    for (std::size_t i = 0; i < primitives.size(); ++i)
+    {
+        OSL::ShaderGroup *group = primitives[i]->shaderGroup().get();
+        if (group != NULL && seen.insert(group).second)
+            groups.push_back(group);
+    }
+    if (backgroundShaderGroup && seen.insert(backgroundShaderGroup.get()).second)
+        groups.push_back(backgroundShaderGroup.get());
+
+    if (groups.empty())
+        return;
+
+    threads = std::min(threads, (int)groups.size());
+
+    OIIO::Timer timer;
+    std::vector<double> times(groups.size(), 0.0);
+    std::atomic<int> next(0);
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i)
+        workers.push_back(std::thread(optimizeShaderGroups, shadingSystem, std::cref(groups), &times, &next));
+    optimizeShaderGroups(shadingSystem, groups, &times, &next);
+    for (std::size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+
+    for (std::size_t i = 0; i < groups.size(); ++i)
+    {
+        OSL::ustring name;
+        shadingSystem->getattribute(groups[i], "groupname", OIIO::TypeDesc::STRING, &name);
+        core::Info("Shader group %d \"%s\": optimized in %.3f s", (int)i, name.empty() ? "" : name.c_str(), times[i]);
+    }
+    core::Info("Prepared %d shader groups in %.3f s on %d threads", (int)groups.size(), timer(), threads);
+}
+
+// sets an attribute of the texture system from a parameter of the render
+// command, without the parameter the attribute keeps its current value
+template <typename T>
+static T textureOption(OIIO::TextureSystem *textureSystem, core::ParameterMap &params, const char *name, OIIO::TypeDesc::BASETYPE type, const char *attribute)
+{
+    T value = T();
+    textureSystem->getattribute(attribute, value);
+    value = params.find(name, type, value);
+    textureSystem->attribute(attribute, value);
+    return value;
+}
+
+static void configureTextureSystem(OIIO::TextureSystem *textureSystem, core::ParameterMap &params)
+{
+    float maxMemory = textureOption<float>(textureSystem, params, "texturememory", OIIO::TypeDesc::FLOAT, "max_memory_MB");
+    int maxOpenFiles = textureOption<int>(textureSystem, params, "textureopenfiles", OIIO::TypeDesc::INT, "max_open_files");
+
+    // tile size for untiled files, 0 reads them whole
+    int autotile = textureOption<int>(textureSystem, params, "textureautotile", OIIO::TypeDesc::INT, "autotile");
+    int automip = textureOption<int>(textureSystem, params, "textureautomip", OIIO::TypeDesc::INT, "automip");
+    int acceptUntiled = textureOption<int>(textureSystem, params, "textureacceptuntiled", OIIO::TypeDesc::INT, "accept_untiled");
+    int acceptUnmipped = textureOption<int>(textureSystem, params, "textureacceptunmipped", OIIO::TypeDesc::INT, "accept_unmipped");
+
+    core::Info("Texture cache: %.0f MB, %d open files, autotile %d, automip %d, accept untiled %d, accept unmipped %d",
+               maxMemory, maxOpenFiles, autotile, automip, acceptUntiled, acceptUnmipped);
+}
+
 //valid states
 //STATE_WORLD
 void PaprikaAPI::render()
@@ -340,12 +489,55 @@ void PaprikaAPI::render()
         return;
     }
 
+    core::Sampler *sampler;
+    std::string samplerName = d_->params.find("sampler", OIIO::TypeDesc::STRING, "sobol");
+    if (samplerName == "sobol")
+        sampler = sampler::SobolSampler::create(d_->params);
+    else if (samplerName == "pmj02")
+        sampler = sampler::PMJ02Sampler::create(d_->params);
+    else if (samplerName == "independent")
+        sampler = sampler::IndependentSampler::create(d_->params);
+    else
+    {
+        core::Error("Unrecognized sampler \"%s\". Using sobol sampler.", samplerName.c_str());
+        sampler = sampler::SobolSampler::create(d_->params);
+    }
+
+    int threads = d_->params.find("threads", OIIO::TypeDesc::INT, 0);
+    if (threads <= 0)
+        threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+    // the statistics are reported for this render only
+    configureTextureSystem(d_->textureSystem, d_->params);
+    d_->textureSystem->reset_stats();
+    int textureStats = d_->params.find("texturestats", OIIO::TypeDesc::INT, 1);
+
+    prepareShaderGroups(d_->shadingSystem, d_->primitives, d_->backgroundShaderGroup, threads);
+
     core::Scene *scene = new core::Scene(d_->rtcDevice, d_->primitives);
-    core::Renderer *renderer = new renderer::PathTracer(scene, d_->camera, d_->backgroundShaderGroup, d_->shadingSystem);
+    core::Renderer *renderer;
+    std::string integratorName = d_->params.find("integrator", OIIO::TypeDesc::STRING, "pathtracer");
+    if (integratorName == "pathtracer")
+        renderer = new renderer::PathTracer(scene, d_->camera, sampler, d_->backgroundShaderGroup, d_->environmentLight, d_->shadingSystem, d_->params);
+    else if (integratorName == "wavefront")
+        renderer = new renderer::WavefrontPathTracer(scene, d_->camera, sampler, d_->backgroundShaderGroup, d_->environmentLight, d_->shadingSystem, d_->params);
+    else
+    {
+        core::Error("Unrecognized integrator \"%s\". Using path tracer.", integratorName.c_str());
+        renderer = new renderer::PathTracer(scene, d_->camera, sampler, d_->backgroundShaderGroup, d_->environmentLight, d_->shadingSystem, d_->params);
+    }
     // core::Renderer *renderer = new renderer::DebugRenderer(scene, d_->camera, d_->backgroundShaderGroup, d_->shadingSystem);
+
+    d_->params.reportUnused("render");
+    d_->params.clear();
+
     d_->rendererService.setRenderer(renderer);
     renderer->render();
     d_->rendererService.setRenderer(NULL);
+
+    if (textureStats > 0)
+        core::Info("Texture statistics:\n%s", d_->textureSystem->getstats(textureStats).c_str());
+
     delete renderer;
     scene->unref();
 
@@ -361,9 +553,33 @@ void PaprikaAPI::shaderGroupBegin()
     }
 
     d_->shaderGroup = d_->shadingSystem->ShaderGroupBegin();
+    d_->shaderGroupKey.clear();
+    d_->shaderGroupParams.clear();
     d_->state = STATE_SHADER;
 }
 
+// appends the name, type and value of the parameter to the key of a
+// shader group
+static void appendParamKey(std::string &key, const OIIO::ustring &name, const core::ParamItem &param)
+{
+    key += name.string();
+    key += '\0';
+    key += param.type.type.c_str();
+    key += '\0';
+
+    if (param.type.type.basetype == OIIO::TypeDesc::STRING)
+    {
+        int count = std::max(1, param.type.type.arraylen);
+        for (int i = 0; i < count; ++i)
+        {
+            key += param.strings[i] ? param.strings[i] : "";
+            key += '\0';
+        }
+    }
+    else
+        key.append(param.data, param.type.type.size());
+}
+
 void PaprikaAPI::shader(const char *shaderusage, const char *shadername, const char *layername)
 {
     if (d_->state != STATE_SHADER)
@@ -372,16 +588,65 @@ void PaprikaAPI::shader(const char *shaderusage, const char *shadername, const c
         return;
     }
 
+    // parameters named in "userdata" are left unlocked, so that primitives
+    // can override them and groups that only differ in them can be shared
+    std::set<std::string> userdata;
+    std::istringstream userdataNames(d_->params.find("userdata", OIIO::TypeDesc::STRING, ""));
+    for (std::string name; userdataNames >> name;)
+        userdata.insert(name);
+
     for (core::ParameterMap::iterator iter = d_->params.begin(); iter != d_->params.end(); ++iter)
     {
         const OIIO::ustring& name = iter->first;
         const core::ParamItem &param = iter->second;
-        d_->shadingSystem->Parameter(name.c_str(), param.type.type, param.ptr);
+
+        if (name == "userdata")
+            continue;
+
+        bool isUserdata = userdata.erase(name.string()) != 0;
+        if (isUserdata && param.type.type.basetype == OIIO::TypeDesc::STRING)
+        {
+            core::Error("String parameter \"%s\" cannot be userdata. Binding it in the shader group.", name.c_str());
+            isUserdata = false;
+        }
+
+        d_->shadingSystem->Parameter(name.c_str(), param.type.type, param.ptr, !isUserdata);
         param.lookedup = true;      // TODO: don't lookedup ununsed parameters
+
+        if (isUserdata)
+        {
+            GeometryParam geometryParam;
+            geometryParam.name = name;
+            geometryParam.type = core::ParamType(param.type.type, core::INTERP_CONSTANT);
+            geometryParam.data.assign(param.data, param.data + param.type.type.size());
+            d_->shaderGroupParams.push_back(geometryParam);
+
+            // only the name and type make it into the key, not the value
+            d_->shaderGroupKey += "userdata";
+            d_->shaderGroupKey += '\0';
+            d_->shaderGroupKey += name.string();
+            d_->shaderGroupKey += '\0';
+            d_->shaderGroupKey += param.type.type.c_str();
+            d_->shaderGroupKey += '\0';
+        }
+        else
+            appendParamKey(d_->shaderGroupKey, name, param);
     }
 
+    for (std::set<std::string>::iterator iter = userdata.begin(); iter != userdata.end(); ++iter)
+        core::Warning("Userdata parameter \"%s\" not given to layer \"%s\"", iter->c_str(), layername);
+
     d_->shadingSystem->Shader(shaderusage, shadername, layername);
 
+    d_->shaderGroupKey += "shader";
+    d_->shaderGroupKey += '\0';
+    d_->shaderGroupKey += shaderusage;
+    d_->shaderGroupKey += '\0';
+    d_->shaderGroupKey += shadername;
+    d_->shaderGroupKey += '\0';
+    d_->shaderGroupKey += layername;
+    d_->shaderGroupKey += '\0';
+
     d_->shaderTransform = d_->ctm;
 
     d_->params.reportUnused(layername);
@@ -398,6 +663,15 @@ void PaprikaAPI::connectShaders(const char* srclayer, const char* srcparam,
     }
         
     d_->shadingSystem->ConnectShaders(srclayer, srcparam, dstlayer, dstparam);
+
+    const char *args[4] = { srclayer, srcparam, dstlayer, dstparam };
+    d_->shaderGroupKey += "connect";
+    d_->shaderGroupKey += '\0';
+    for (int i = 0; i < 4; ++i)
+    {
+        d_->shaderGroupKey += args[i];
+        d_->shaderGroupKey += '\0';
+    }
 }
 
 void PaprikaAPI::shaderGroupEnd()
@@ -410,6 +684,17 @@ void PaprikaAPI::shaderGroupEnd()
 
     d_->shadingSystem->ShaderGroupEnd();
     d_->state = STATE_WORLD;
+
+    d_->geometryParams.swap(d_->shaderGroupParams);
+    d_->shaderGroupParams.clear();
+
+    // a group identical to an earlier one is dropped in favour of that one,
+    // so that it is only stored, optimized and compiled once
+    std::map<std::string, OSL::ShaderGroupRef>::iterator iter = d_->shaderGroups.find(d_->shaderGroupKey);
+    if (iter != d_->shaderGroups.end())
+        d_->shaderGroup = iter->second;
+    else
+        d_->shaderGroups[d_->shaderGroupKey] = d_->shaderGroup;
 }
 
 
@@ -0,0 +1,94 @@
+#include <core/aliastable.hpp>
+#include <algorithm>
+#include <cstddef>
+
+namespace paprika {
+namespace core {
+
+void AliasTable::build(const float *weights, int count)
+{
+    bins_.resize(count);
+
+    if (count == 0)
+        return;
+
+    double sum = 0;
+    for (int i = 0; i < count; ++i)
+        sum += std::max(0.f, weights[i]);
+
+    for (int i = 0; i < count; ++i)
+        bins_[i].pdf = sum > 0 ? (float)(std::max(0.f, weights[i]) / sum) : 1.f / count;
+
+    // scaled probabilities, split into bins below and above the average
+    std::vector<double> scaled(count);
+    std::vector<int> small, large;
+    for (int i = 0; i < count; ++i)
+    {
+        scaled[i] = (double)bins_[i].pdf * count;
+        if (scaled[i] < 1)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+
+    while (!small.empty() && !large.empty())
+    {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+
+        bins_[s].q = (float)scaled[s];
+        bins_[s].alias = l;
+
+        // the large bin gives away what fills up the small one
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // what is left over is one up to rounding
+    for (std::size_t i = 0; i < small.size(); ++i)
+    {
+        bins_[small[i]].q = 1.f;
+        bins_[small[i]].alias = small[i];
+    }
+
+    for (std::size_t i = 0; i < large.size(); ++i)
+    {
+        bins_[large[i]].q = 1.f;
+        bins_[large[i]].alias = large[i];
+    }
+}
+
+int AliasTable::sample(float u, float *pdf, float *uRemapped) const
+{
+    int count = (int)bins_.size();
+
+    // the integer part picks the bin, the fraction picks the bin or its alias
+    float x = u * count;
+    int i = std::min((int)x, count - 1);
+    float up = std::min(x - i, 0.99999994f);
+
+    if (up < bins_[i].q)
+    {
+        if (uRemapped)
+            *uRemapped = std::min(up / bins_[i].q, 0.99999994f);
+    }
+    else
+    {
+        if (uRemapped)
+            *uRemapped = std::min((up - bins_[i].q) / (1 - bins_[i].q), 0.99999994f);
+        i = bins_[i].alias;
+    }
+
+    if (pdf)
+        *pdf = bins_[i].pdf;
+
+    return i;
+}
+
+}
+}
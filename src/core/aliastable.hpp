@@ -0,0 +1,55 @@
+#ifndef CORE_ALIASTABLE_HPP
+#define CORE_ALIASTABLE_HPP
+
+#include <vector>
+#include <cstddef>
+
+namespace paprika {
+namespace core {
+
+// Samples an index in proportion to a set of weights in constant time
+// (Vose's alias method).
+class AliasTable
+{
+public:
+    AliasTable() {}
+
+    // negative weights count as zero. if all weights are zero, every index
+    // is equally likely.
+    void build(const float *weights, int count);
+
+    bool empty() const
+    {
+        return bins_.empty();
+    }
+
+    int size() const
+    {
+        return (int)bins_.size();
+    }
+
+    // u is a uniform sample in [0, 1). uRemapped receives a new uniform
+    // sample, made from what is left of u after picking the index.
+    int sample(float u, float *pdf = NULL, float *uRemapped = NULL) const;
+
+    // probability of sampling index i
+    float pdf(int i) const
+    {
+        return bins_[i].pdf;
+    }
+
+private:
+    struct Bin
+    {
+        float q;        // probability of keeping the bin rather than its alias
+        int alias;
+        float pdf;
+    };
+
+    std::vector<Bin> bins_;
+};
+
+}
+}
+
+#endif
@@ -2,6 +2,9 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string>
+#include <atomic>
+#include <cstdlib>
+#include <new>
 
 namespace paprika {
 namespace core {
@@ -62,5 +65,59 @@ LIBPAPRIKA_EXPORT void Severe(const char *format, ...)
 	va_end(args);
 }
 
+#ifdef PAPRIKA_COUNT_ALLOCATIONS
+static thread_local bool countAllocations = false;
+static std::atomic<long long> allocationCount(0);
+
+static void *countedAlloc(std::size_t size)
+{
+	if (countAllocations)
+		++allocationCount;
+
+	void *p = malloc(size ? size : 1);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+#endif
+
+LIBPAPRIKA_EXPORT void CountAllocations(bool enable)
+{
+#ifdef PAPRIKA_COUNT_ALLOCATIONS
+	countAllocations = enable;
+#endif
+}
+
+LIBPAPRIKA_EXPORT long long AllocationCount()
+{
+#ifdef PAPRIKA_COUNT_ALLOCATIONS
+	return allocationCount;
+#else
+	return 0;
+#endif
+}
+
 }		/* util */
 }		/* paprika */
+
+#ifdef PAPRIKA_COUNT_ALLOCATIONS
+void *operator new(std::size_t size)
+{
+	return paprika::core::countedAlloc(size);
+}
+
+void *operator new[](std::size_t size)
+{
+	return paprika::core::countedAlloc(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+#endif
@@ -19,6 +19,13 @@ extern LIBPAPRIKA_EXPORT void Warning(const char *, ...) GNUG_PRINTF_FUNC;
 extern LIBPAPRIKA_EXPORT void Error(const char *, ...) GNUG_PRINTF_FUNC;
 extern LIBPAPRIKA_EXPORT void Severe(const char *, ...) GNUG_PRINTF_FUNC;
 
+// Counts the operator new calls of the threads that enabled counting, to
+// check that the rendering hot path doesn't allocate. Only counts when built
+// with PAPRIKA_COUNT_ALLOCATIONS, otherwise the count stays zero. The
+// paprika_allocations test target is built that way.
+extern LIBPAPRIKA_EXPORT void CountAllocations(bool enable);
+extern LIBPAPRIKA_EXPORT long long AllocationCount();
+
 #ifdef NDEBUG
 #define Assert(expr) ((void)0)
 #else
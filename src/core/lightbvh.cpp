@@ -0,0 +1,299 @@
+#include <core/lightbvh.hpp>
+#include <core/primitive.hpp>
+#include <algorithm>
+
+namespace paprika {
+namespace core {
+
+struct LightBVH::BuildItem
+{
+    core::Primitive *light;
+    core::BBox bounds;
+    core::Vec3 centroid;
+    core::Vec3 axis;
+    float cosTheta;
+    float power;
+};
+
+struct LightBVH::CentroidLess
+{
+    CentroidLess(int axis) : axis(axis) {}
+
+    bool operator()(const BuildItem &a, const BuildItem &b) const
+    {
+        return a.centroid[axis] < b.centroid[axis];
+    }
+
+    int axis;
+};
+
+static float safeSqrt(float x)
+{
+    return sqrtf(std::max(0.f, x));
+}
+
+static float safeAcos(float x)
+{
+    return acosf(std::min(1.f, std::max(-1.f, x)));
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) given the sines and cosines
+static float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    if (cosA > cosB)
+        return 1.f;
+    return cosA * cosB + sinA * sinB;
+}
+
+static float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    if (cosA > cosB)
+        return 0.f;
+    return sinA * cosB - cosA * sinB;
+}
+
+// rotates v around the unit axis k
+static core::Vec3 rotate(const core::Vec3 &v, const core::Vec3 &k, float angle)
+{
+    float c = cosf(angle);
+    float s = sinf(angle);
+    return v * c + k.cross(v) * s + k * (k.dot(v) * (1 - c));
+}
+
+// smallest cone that contains both cones
+static void unionCones(const core::Vec3 &axisA, float cosA, const core::Vec3 &axisB, float cosB, core::Vec3 *axis, float *cosTheta)
+{
+    float thetaA = safeAcos(cosA);
+    float thetaB = safeAcos(cosB);
+    float thetaD = safeAcos(axisA.dot(axisB));
+
+    if (std::min(thetaD + thetaB, F_PI) <= thetaA)
+    {
+        *axis = axisA;
+        *cosTheta = cosA;
+        return;
+    }
+
+    if (std::min(thetaD + thetaA, F_PI) <= thetaB)
+    {
+        *axis = axisB;
+        *cosTheta = cosB;
+        return;
+    }
+
+    float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+    core::Vec3 k = axisA.cross(axisB);
+
+    if (thetaO >= F_PI || k.length2() == 0)
+    {
+        *axis = axisA;
+        *cosTheta = -1.f;
+        return;
+    }
+
+    *axis = rotate(axisA, k.normalized(), thetaO - thetaA).normalized();
+    *cosTheta = cosf(thetaO);
+}
+
+LightBVH::LightBVH()
+{
+}
+
+void LightBVH::build(const std::vector<core::Primitive*> &lights, const std::vector<float> &power)
+{
+    nodes_.clear();
+    lights_.clear();
+    trails_.clear();
+
+    std::vector<BuildItem> items;
+    for (std::size_t i = 0; i < lights.size(); ++i)
+    {
+        if (!(power[i] > 0))
+            continue;
+
+        BuildItem item;
+        item.light = lights[i];
+        item.bounds = lights[i]->bounds();
+        item.centroid = item.bounds.center();
+        lights[i]->normalCone(&item.axis, &item.cosTheta);
+        item.power = power[i];
+        items.push_back(item);
+    }
+
+    if (items.empty())
+        return;
+
+    nodes_.reserve(2 * items.size() - 1);
+    build(items, 0, (int)items.size(), 0, 0);
+}
+
+int LightBVH::build(std::vector<BuildItem> &items, int begin, int end, uint64_t trail, int depth)
+{
+    int nodeIndex = (int)nodes_.size();
+    nodes_.push_back(Node());
+
+    if (end - begin == 1)
+    {
+        const BuildItem &item = items[begin];
+
+        Node &node = nodes_[nodeIndex];
+        node.bounds = item.bounds;
+        node.axis = item.axis;
+        node.cosTheta = item.cosTheta;
+        node.power = item.power;
+        node.index = (int)lights_.size();
+        node.isLeaf = true;
+
+        lights_.push_back(item.light);
+        trails_[item.light] = trail;
+
+        return nodeIndex;
+    }
+
+    // split at the median of the centroids along their largest extent, the
+    // tree stays balanced so the trails fit in 64 bits
+    core::BBox centroidBounds;
+    for (int i = begin; i < end; ++i)
+        centroidBounds.extendBy(items[i].centroid);
+
+    int axis = centroidBounds.majorAxis();
+    int mid = (begin + end) / 2;
+    std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, CentroidLess(axis));
+
+    int child0 = build(items, begin, mid, trail, depth + 1);
+    int child1 = build(items, mid, end, trail | ((uint64_t)1 << depth), depth + 1);
+
+    // nodes_ may have been reallocated by the children
+    Node &node = nodes_[nodeIndex];
+    const Node &node0 = nodes_[child0];
+    const Node &node1 = nodes_[child1];
+
+    node.bounds = node0.bounds;
+    node.bounds.extendBy(node1.bounds);
+    unionCones(node0.axis, node0.cosTheta, node1.axis, node1.cosTheta, &node.axis, &node.cosTheta);
+    node.power = node0.power + node1.power;
+    node.index = child1;
+    node.isLeaf = false;
+
+    return nodeIndex;
+}
+
+float LightBVH::importance(const Node &node, const core::Vec3 &p, const core::Vec3 &n)
+{
+    core::Vec3 pc = node.bounds.center();
+    core::Vec3 d = p - pc;
+
+    float radius2 = (node.bounds.max - pc).length2();
+    float d2 = std::max(d.length2(), radius2);
+
+    // angle between the emitter normals and the direction to the point,
+    // reduced by the spread of the normals and by the angle subtended by
+    // the bounds
+    core::Vec3 wi = d.normalized();
+
+    float cosThetaW = node.axis.dot(wi);
+    float sinThetaW = safeSqrt(1 - cosThetaW * cosThetaW);
+
+    float cosThetaB = d.length2() < radius2 ? -1.f : safeSqrt(1 - radius2 / d.length2());
+    float sinThetaB = safeSqrt(1 - cosThetaB * cosThetaB);
+
+    float sinThetaO = safeSqrt(1 - node.cosTheta * node.cosTheta);
+
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosTheta);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosTheta);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+
+    // area lights emit on the side of their normal
+    if (cosThetaP <= 0)
+        return 0.f;
+
+    // the receiver may transmit, so both sides of n count
+    float cosThetaI = fabsf(wi.dot(n));
+    float sinThetaI = safeSqrt(1 - cosThetaI * cosThetaI);
+    float cosThetaPI = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+
+    return std::max(0.f, node.power * cosThetaP * cosThetaPI / d2);
+}
+
+core::Primitive *LightBVH::sample(const core::Vec3 &p, const core::Vec3 &n, float u, float *pmf) const
+{
+    *pmf = 0.f;
+
+    if (nodes_.empty() || importance(nodes_[0], p, n) == 0)
+        return NULL;
+
+    float prob = 1.f;
+    int nodeIndex = 0;
+
+    while (!nodes_[nodeIndex].isLeaf)
+    {
+        const Node &node = nodes_[nodeIndex];
+
+        float i0 = importance(nodes_[nodeIndex + 1], p, n);
+        float i1 = importance(nodes_[node.index], p, n);
+
+        if (i0 == 0 && i1 == 0)
+            return NULL;
+
+        // pick a child and remap u to reuse it further down
+        float p0 = i0 / (i0 + i1);
+        if (u < p0)
+        {
+            u = std::min(u / p0, 0.99999994f);
+            prob *= p0;
+            nodeIndex = nodeIndex + 1;
+        }
+        else
+        {
+            u = std::min((u - p0) / (1 - p0), 0.99999994f);
+            prob *= 1 - p0;
+            nodeIndex = node.index;
+        }
+    }
+
+    *pmf = prob;
+    return lights_[nodes_[nodeIndex].index];
+}
+
+float LightBVH::pmf(const core::Vec3 &p, const core::Vec3 &n, const core::Primitive *light) const
+{
+    std::map<const core::Primitive*, uint64_t>::const_iterator iter = trails_.find(light);
+    if (iter == trails_.end() || importance(nodes_[0], p, n) == 0)
+        return 0.f;
+
+    uint64_t trail = iter->second;
+
+    float prob = 1.f;
+    int nodeIndex = 0;
+
+    while (!nodes_[nodeIndex].isLeaf)
+    {
+        const Node &node = nodes_[nodeIndex];
+
+        float i0 = importance(nodes_[nodeIndex + 1], p, n);
+        float i1 = importance(nodes_[node.index], p, n);
+
+        if (i0 == 0 && i1 == 0)
+            return 0.f;
+
+        // same arithmetic as sample()
+        float p0 = i0 / (i0 + i1);
+        if (trail & 1)
+        {
+            prob *= 1 - p0;
+            nodeIndex = node.index;
+        }
+        else
+        {
+            prob *= p0;
+            nodeIndex = nodeIndex + 1;
+        }
+
+        trail >>= 1;
+    }
+
+    return prob;
+}
+
+}
+}
@@ -0,0 +1,69 @@
+#ifndef CORE_LIGHTBVH_HPP
+#define CORE_LIGHTBVH_HPP
+
+#include <core/geometry.hpp>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+namespace paprika {
+namespace core {
+
+class Primitive;
+
+// Bounding volume hierarchy over the emissive primitives, used to pick a
+// light for a shading point in proportion to a conservative estimate of
+// its contribution. Nodes bound the positions, the emitted power and the
+// normals of their lights. Based on "Importance Sampling of Many Lights
+// with Adaptive Tree Splitting" by Conty Estevez and Kulla.
+class LightBVH
+{
+public:
+    LightBVH();
+
+    // power holds the emitted power of each light, lights without power
+    // are never picked
+    void build(const std::vector<core::Primitive*> &lights, const std::vector<float> &power);
+
+    bool empty() const
+    {
+        return nodes_.empty();
+    }
+
+    // picks a light for the point p with normal n, u is a uniform sample.
+    // returns NULL if no light can contribute.
+    core::Primitive *sample(const core::Vec3 &p, const core::Vec3 &n, float u, float *pmf) const;
+
+    // probability of sample() picking the light
+    float pmf(const core::Vec3 &p, const core::Vec3 &n, const core::Primitive *light) const;
+
+private:
+    struct Node
+    {
+        core::BBox bounds;
+        core::Vec3 axis;        // normal cone
+        float cosTheta;
+        float power;
+        int index;              // second child of interior nodes, light of leaves
+        bool isLeaf;
+    };
+
+    struct BuildItem;
+    struct CentroidLess;
+
+    int build(std::vector<BuildItem> &items, int begin, int end, uint64_t trail, int depth);
+
+    static float importance(const Node &node, const core::Vec3 &p, const core::Vec3 &n);
+
+    std::vector<Node> nodes_;
+    std::vector<core::Primitive*> lights_;
+
+    // child choices from the root to the leaf of a light, bit i selects the
+    // child at depth i
+    std::map<const core::Primitive*, uint64_t> trails_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,94 @@
+#include <core/memoryarena.hpp>
+#include <core/debug.hpp>
+#include <algorithm>
+#include <cstdlib>
+
+namespace paprika {
+namespace core {
+
+// blocks come from malloc rather than operator new, so that the debug
+// allocation counter only sees allocations outside the arena. malloc aligns
+// to 16 bytes, which is also the largest alignment the arena hands out.
+struct MemoryArena::Block
+{
+    Block *next;
+    std::size_t size;
+
+    char *data()
+    {
+        return reinterpret_cast<char*>(this) + headerSize();
+    }
+
+    static std::size_t headerSize()
+    {
+        return (sizeof(Block) + 15) & ~std::size_t(15);
+    }
+};
+
+MemoryArena::MemoryArena(std::size_t blockSize) : blockSize_(blockSize), current_(NULL), used_(0), total_(0)
+{
+}
+
+MemoryArena::~MemoryArena()
+{
+    release();
+}
+
+void *MemoryArena::alloc(std::size_t size, std::size_t align)
+{
+    Assert(align > 0 && (align & (align - 1)) == 0 && align <= 16);
+
+    std::size_t offset = (used_ + align - 1) & ~(align - 1);
+    if (current_ == NULL || offset + size > current_->size)
+    {
+        grow(size);
+        offset = 0;
+    }
+
+    used_ = offset + size;
+    return current_->data() + offset;
+}
+
+void MemoryArena::reset()
+{
+    if (current_ != NULL && current_->next != NULL)
+    {
+        std::size_t total = total_;
+        release();
+        grow(total);
+    }
+
+    used_ = 0;
+}
+
+void MemoryArena::grow(std::size_t size)
+{
+    size = std::max(size, blockSize_);
+
+    Block *block = static_cast<Block*>(std::malloc(Block::headerSize() + size));
+    if (block == NULL)
+        Severe("Out of memory allocating a %lu byte arena block", (unsigned long)size);
+
+    block->next = current_;
+    block->size = size;
+
+    current_ = block;
+    used_ = 0;
+    total_ += size;
+}
+
+void MemoryArena::release()
+{
+    while (current_ != NULL)
+    {
+        Block *next = current_->next;
+        std::free(current_);
+        current_ = next;
+    }
+
+    used_ = 0;
+    total_ = 0;
+}
+
+}
+}
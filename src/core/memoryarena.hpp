@@ -0,0 +1,55 @@
+#ifndef CORE_MEMORYARENA_HPP
+#define CORE_MEMORYARENA_HPP
+
+#include <cstddef>
+#include <new>
+
+namespace paprika {
+namespace core {
+
+// Per-thread scratch memory that is handed out linearly and released all at
+// once. After a reset the memory is reused, so once the arena has grown to
+// the size that one unit of work needs, it stops touching the heap. Objects
+// in the arena are never destroyed, so they must not own memory.
+class MemoryArena
+{
+public:
+    explicit MemoryArena(std::size_t blockSize = 256 * 1024);
+    ~MemoryArena();
+
+    // align is at most 16
+    void *alloc(std::size_t size, std::size_t align = 16);
+
+    // count value initialized objects
+    template <typename T>
+    T *alloc(int count)
+    {
+        T *p = static_cast<T*>(alloc(count * sizeof(T), alignof(T)));
+        for (int i = 0; i < count; ++i)
+            new (&p[i]) T();
+        return p;
+    }
+
+    // makes all memory available again. if the last round needed more than
+    // one block, the blocks are merged into one that fits it.
+    void reset();
+
+private:
+    MemoryArena(const MemoryArena&);
+    MemoryArena& operator=(const MemoryArena&);
+
+    struct Block;
+
+    void grow(std::size_t size);
+    void release();
+
+    std::size_t blockSize_;
+    Block *current_;        // the blocks are chained from the newest one
+    std::size_t used_;      // bytes used in the current block
+    std::size_t total_;     // size of all the blocks
+};
+
+}
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include <core/primitive.hpp>
+#include <string.h>
 
 namespace paprika {
 namespace core {
@@ -12,6 +13,10 @@ Primitive::Primitive(Shape *shape, const core::Transform &objectToWorld, OSL::Sh
     shaderGroup_ = shaderGroup;
     shaderToWorld_ = shaderToWorld;
     isEmissive_ = isEmissive;
+    hasConstantEmission_ = false;
+    constantEmission_ = core::Color3(0.f, 0.f, 0.f);
+    globalsNeeded_ = NEEDS_ALL;
+    hasUserdata_ = false;
 }
 
 Primitive::~Primitive()
@@ -19,14 +24,260 @@ Primitive::~Primitive()
     shape_->unref();
 }
 
+void Primitive::queryGlobalsNeeded(OSL::ShadingSystem *shadingSystem)
+{
+    globalsNeeded_ = NEEDS_ALL;
+    hasUserdata_ = false;
+
+    if (!shaderGroup_)
+        return;
+
+    int nGlobals = 0;
+    OSL::ustring *globals = NULL;
+    if (!shadingSystem->getattribute(shaderGroup_.get(), "num_globals_needed", OIIO::TypeDesc::TypeInt, &nGlobals) ||
+        !shadingSystem->getattribute(shaderGroup_.get(), "globals_needed", OIIO::TypeDesc::PTR, &globals))
+        return;
+
+    globalsNeeded_ = 0;
+    for (int i = 0; i < nGlobals; ++i)
+    {
+        if (globals[i] == "u" || globals[i] == "v")
+            globalsNeeded_ |= NEEDS_UV;
+        else if (globals[i] == "dPdu" || globals[i] == "dPdv")
+            globalsNeeded_ |= NEEDS_DPDUV;
+        else if (globals[i] == "N")
+            globalsNeeded_ |= NEEDS_N;
+    }
+}
+
+// interpolation kernels for userdata, each one handles a single case of
+// Shape::interpolate and Primitive::interpolate without testing the type or
+// the interpolation mode. derivatives, if asked for, follow the value.
+
+static void userdataConstant(const Primitive &primitive, const core::ParamItem &paramItem, const InterpolationInfo &interp, bool derivatives, void *val)
+{
+    int datasize = paramItem.type.type.size();
+    memcpy(val, paramItem.data, datasize);
+    if (derivatives)
+        memset(static_cast<char*>(val) + datasize, 0, 2 * datasize);
+}
+
+static void userdataPerPiece(const Primitive &primitive, const core::ParamItem &paramItem, const InterpolationInfo &interp, bool derivatives, void *val)
+{
+    int datasize = paramItem.type.type.size();
+    memcpy(val, paramItem.data + interp.ipiece * datasize, datasize);
+    if (derivatives)
+        memset(static_cast<char*>(val) + datasize, 0, 2 * datasize);
+}
+
+template <ParamInterp interpMode>
+static void userdataFloat(const Primitive &primitive, const core::ParamItem &paramItem, const InterpolationInfo &interp, bool derivatives, void *val)
+{
+    float sum = 0.f, dx = 0.f, dy = 0.f;
+    for (int j = 0; j < interp.nweights; ++j)
+    {
+        const InterpolationInfo::Weight &w = interp.weights[j];
+        float f = paramItem.floats[interpMode == INTERP_VERTEX ? w.ivertex : w.ilinear];
+        sum += f * w.weight.val();
+        dx += f * w.weight.dx();
+        dy += f * w.weight.dy();
+    }
+
+    float *out = static_cast<float*>(val);
+    out[0] = sum;
+    if (derivatives)
+    {
+        out[1] = dx;
+        out[2] = dy;
+    }
+}
+
+enum TripleSpace
+{
+    TRIPLE_COLOR,       // not transformed
+    TRIPLE_POINT,
+    TRIPLE_VECTOR,
+    TRIPLE_NORMAL
+};
+
+template <ParamInterp interpMode, TripleSpace space>
+static void userdataTriple(const Primitive &primitive, const core::ParamItem &paramItem, const InterpolationInfo &interp, bool derivatives, void *val)
+{
+    const core::Vec3 *triples = reinterpret_cast<const core::Vec3*>(paramItem.floats);
+
+    core::Vec3 sum(0.f, 0.f, 0.f), dx(0.f, 0.f, 0.f), dy(0.f, 0.f, 0.f);
+    for (int j = 0; j < interp.nweights; ++j)
+    {
+        const InterpolationInfo::Weight &w = interp.weights[j];
+        const core::Vec3 &triple = triples[interpMode == INTERP_VERTEX ? w.ivertex : w.ilinear];
+        sum += triple * w.weight.val();
+        dx += triple * w.weight.dx();
+        dy += triple * w.weight.dy();
+    }
+
+    const core::Transform &objectToWorld = primitive.objectToWorld();
+
+    switch (space)
+    {
+        case TRIPLE_COLOR:
+            break;
+        case TRIPLE_POINT:
+            sum = objectToWorld.transformPoint(sum);
+            dx = objectToWorld.transformVector(dx);
+            dy = objectToWorld.transformVector(dy);
+            break;
+        case TRIPLE_VECTOR:
+            sum = objectToWorld.transformVector(sum);
+            dx = objectToWorld.transformVector(dx);
+            dy = objectToWorld.transformVector(dy);
+            break;
+        case TRIPLE_NORMAL:
+            sum = objectToWorld.transformNormal(sum).normalized();
+            dx = objectToWorld.transformNormal(dx);
+            dy = objectToWorld.transformNormal(dy);
+            break;
+    }
+
+    core::Vec3 *out = static_cast<core::Vec3*>(val);
+    out[0] = sum;
+    if (derivatives)
+    {
+        out[1] = dx;
+        out[2] = dy;
+    }
+}
+
+// arrays, matrices and transformed constants
+static void userdataGeneric(const Primitive &primitive, const core::ParamItem &paramItem, const InterpolationInfo &interp, bool derivatives, void *val)
+{
+    primitive.interpolate(paramItem, interp, derivatives, val);
+}
+
+typedef void (*TripleKernel)(const Primitive &primitive, const core::ParamItem &paramItem, const InterpolationInfo &interp, bool derivatives, void *val);
+
+template <ParamInterp interpMode>
+static TripleKernel userdataTripleKernel(const OIIO::TypeDesc &type)
+{
+    switch (type.vecsemantics)
+    {
+        case OIIO::TypeDesc::POINT:
+            return userdataTriple<interpMode, TRIPLE_POINT>;
+        case OIIO::TypeDesc::VECTOR:
+            return userdataTriple<interpMode, TRIPLE_VECTOR>;
+        case OIIO::TypeDesc::NORMAL:
+            return userdataTriple<interpMode, TRIPLE_NORMAL>;
+        default:
+            return userdataTriple<interpMode, TRIPLE_COLOR>;
+    }
+}
+
+Primitive::UserdataKernel Primitive::userdataKernel(const core::ParamItem &paramItem)
+{
+    const OIIO::TypeDesc &type = paramItem.type.type;
+
+    bool isTransformed = type.aggregate == OIIO::TypeDesc::VEC3 &&
+        (type.vecsemantics == OIIO::TypeDesc::POINT || type.vecsemantics == OIIO::TypeDesc::VECTOR || type.vecsemantics == OIIO::TypeDesc::NORMAL);
+
+    switch (paramItem.type.interp)
+    {
+        case INTERP_CONSTANT:
+            return isTransformed ? userdataGeneric : userdataConstant;
+        case INTERP_PERPIECE:
+            return isTransformed ? userdataGeneric : userdataPerPiece;
+        case INTERP_LINEAR:
+        case INTERP_VERTEX:
+            break;
+    }
+
+    if (type.basetype != OIIO::TypeDesc::FLOAT || type.numelements() != 1)
+        return userdataGeneric;
+
+    bool isVertex = paramItem.type.interp == INTERP_VERTEX;
+
+    if (type.aggregate == OIIO::TypeDesc::SCALAR)
+        return isVertex ? userdataFloat<INTERP_VERTEX> : userdataFloat<INTERP_LINEAR>;
+    else if (type.aggregate == OIIO::TypeDesc::VEC3)
+        return isVertex ? userdataTripleKernel<INTERP_VERTEX>(type) : userdataTripleKernel<INTERP_LINEAR>(type);
+
+    return userdataGeneric;
+}
+
+void Primitive::prepareUserdata(OSL::ShadingSystem *shadingSystem)
+{
+    userdata_.clear();
+    hasUserdata_ = false;
+
+    if (!shaderGroup_)
+        return;
+
+    int nUserdata = 0;
+    OSL::ustring *names = NULL;
+    OSL::TypeDesc *types = NULL;
+    if (!shadingSystem->getattribute(shaderGroup_.get(), "num_userdata", OIIO::TypeDesc::TypeInt, &nUserdata) ||
+        !shadingSystem->getattribute(shaderGroup_.get(), "userdata_names", OIIO::TypeDesc::PTR, &names) ||
+        !shadingSystem->getattribute(shaderGroup_.get(), "userdata_types", OIIO::TypeDesc::PTR, &types))
+        return;
+
+    for (int i = 0; i < nUserdata && names != NULL && types != NULL; ++i)
+    {
+        // userdata the shape doesn't have is kept without a kernel, so that
+        // looking it up fails without searching the parameters of the shape
+        const core::ParamItem *paramItem = shape_->getParamItem(names[i]);
+        if (paramItem != NULL && paramItem->type.type != types[i])
+            paramItem = NULL;
+
+        Userdata userdata;
+        userdata.name = names[i];
+        userdata.type = types[i];
+        userdata.paramItem = paramItem;
+        userdata.kernel = paramItem != NULL ? userdataKernel(*paramItem) : NULL;
+        userdata_.push_back(userdata);
+
+        hasUserdata_ |= paramItem != NULL;
+    }
+}
+
+
+bool Primitive::getUserdata(OSL::ustring name, OSL::TypeDesc type, const InterpolationInfo &interp, bool derivatives, void *val) const
+{
+    // every group is optimized before rendering, so the shading system
+    // reports all the userdata a group can ask for
+    for (std::size_t i = 0; i < userdata_.size(); ++i)
+    {
+        const Userdata &userdata = userdata_[i];
+        if (userdata.name == name && userdata.type == type)
+        {
+            if (userdata.kernel == NULL)
+                return false;
+
+            userdata.kernel(*this, *userdata.paramItem, interp, derivatives, val);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void Primitive::fillIntersectionInfo(const core::Ray &ray, int primID, core::InterpolationInfo *interp, OSL::ShaderGlobals *sg)
+{
+    core::RayHit hit;
+    shape_->intersectPrim(worldToObject_.transformRay(ray), primID, &hit);
+
+    fillIntersectionInfo(ray, hit, interp, sg);
+}
+
+void Primitive::fillIntersectionInfo(const core::Ray &ray, const core::RayHit &hit, core::InterpolationInfo *interp, OSL::ShaderGlobals *sg)
 {
     core::Ray rayo = worldToObject_.transformRay(ray);
 
+    // userdata is interpolated with the same weights as u and v, so it
+    // needs their derivatives as well
     core::HitInfo hitInfo;
-    shape_->fillHitInfo(rayo, primID, &hitInfo);
+    shape_->fillHitInfo(rayo, hit, (globalsNeeded_ & NEEDS_UV) != 0 || hasUserdata_, &hitInfo);
 
     shape_->fillInterpolationInfo(hitInfo, interp);
+    interp->primitive = this;
+    interp->primID = hit.primID;
 
     {
         OSL::Dual2<core::Vec3> P = ray.point(hitInfo.t);
@@ -34,41 +285,51 @@ void Primitive::fillIntersectionInfo(const core::Ray &ray, int primID, core::Int
         sg->dPdx = P.dx();
         sg->dPdy = P.dy();
 
-        const core::ParamItem *paramItemU = shape_->getParamItemU();
-        if (paramItemU != NULL)
-        {
-            interpolate(*paramItemU, *interp, false, &sg->u);   // TODO: derivatives
-        }
-        else
+        // parametric coordinates and tangents are only filled in for
+        // shaders that read them
+        if (globalsNeeded_ & NEEDS_UV)
         {
-            sg->u = hitInfo.u.val();
-            sg->dudx = hitInfo.u.dx();
-            sg->dudy = hitInfo.u.dy();
+            const core::ParamItem *paramItemU = shape_->getParamItemU();
+            if (paramItemU != NULL)
+            {
+                interpolate(*paramItemU, *interp, true, &sg->u);       // dudx, dudy follow u
+            }
+            else
+            {
+                sg->u = hitInfo.u.val();
+                sg->dudx = hitInfo.u.dx();
+                sg->dudy = hitInfo.u.dy();
+            }
+
+            const core::ParamItem *paramItemV = shape_->getParamItemV();
+            if (paramItemV != NULL)
+            {
+                interpolate(*paramItemV, *interp, true, &sg->v);       // dvdx, dvdy follow v
+            }
+            else
+            {
+                sg->v = hitInfo.v.val();
+                sg->dvdx = hitInfo.v.dx();
+                sg->dvdy = hitInfo.v.dy();
+            }
         }
 
-        const core::ParamItem *paramItemV = shape_->getParamItemV();
-        if (paramItemV != NULL)
+        if (globalsNeeded_ & NEEDS_DPDUV)
         {
-            interpolate(*paramItemV, *interp, false, &sg->v);   // TODO: derivatives
-        }
-        else
-        {
-            sg->v = hitInfo.v.val();
-            sg->dvdx = hitInfo.v.dx();
-            sg->dvdy = hitInfo.v.dy();
+            sg->dPdu = objectToWorld_.transformVector(hitInfo.dPdu);
+            sg->dPdv = objectToWorld_.transformVector(hitInfo.dPdv);
         }
 
-        sg->dPdu = objectToWorld_.transformVector(hitInfo.dPdu);
-        sg->dPdv = objectToWorld_.transformVector(hitInfo.dPdv);
-
         sg->I = ray.d.val();
         sg->dIdx = ray.d.dx();
         sg->dIdy = ray.d.dy();
 
         sg->Ng = objectToWorld_.transformNormal(hitInfo.Ng).normalized();
 
+        // without a shader reading N the integrator can use the geometric
+        // normal, the closures never see the shading normal
         const core::ParamItem *paramItemN = shape_->getParamItemN();
-        if (paramItemN != NULL)
+        if (paramItemN != NULL && (globalsNeeded_ & NEEDS_N))
             interpolate(*paramItemN, *interp, false, &sg->N);
         else
             sg->N = sg->Ng;
@@ -129,16 +390,23 @@ void Primitive::interpolate(const core::ParamItem &paramitem, const Interpolatio
 
     int arraylen = paramitem.type.type.numelements();
 
+    // derivatives of points are vectors, those of normals are transformed
+    // like normals but not normalized
+    core::Vec3 *derivs = static_cast<core::Vec3*>(paramarea) + arraylen;
+    int nderivs = derivatives ? 2 * arraylen : 0;
+
     if (paramitem.type.type == OIIO::TypeDesc(OIIO::TypeDesc::FLOAT, OIIO::TypeDesc::VEC3, OIIO::TypeDesc::POINT))
     {
         core::Vec3 *points = static_cast<core::Vec3*>(paramarea);
         for (int i = 0; i < arraylen; ++i)
             points[i] = objectToWorld_.transformPoint(points[i]);
+        for (int i = 0; i < nderivs; ++i)
+            derivs[i] = objectToWorld_.transformVector(derivs[i]);
     }
     else if (paramitem.type.type == OIIO::TypeDesc(OIIO::TypeDesc::FLOAT, OIIO::TypeDesc::VEC3, OIIO::TypeDesc::VECTOR))
     {
         core::Vec3 *vectors = static_cast<core::Vec3*>(paramarea);
-        for (int i = 0; i < arraylen; ++i)
+        for (int i = 0; i < arraylen + nderivs; ++i)
             vectors[i] = objectToWorld_.transformVector(vectors[i]);
     }
     else if (paramitem.type.type == OIIO::TypeDesc(OIIO::TypeDesc::FLOAT, OIIO::TypeDesc::VEC3, OIIO::TypeDesc::NORMAL))
@@ -146,8 +414,10 @@ void Primitive::interpolate(const core::ParamItem &paramitem, const Interpolatio
         core::Vec3 *normals = static_cast<core::Vec3*>(paramarea);
         for (int i = 0; i < arraylen; ++i)
             normals[i] = objectToWorld_.transformNormal(normals[i]).normalized();
+        for (int i = 0; i < nderivs; ++i)
+            derivs[i] = objectToWorld_.transformNormal(derivs[i]);
     }
-    // TODO: derivatives, hpoint, matrix
+    // TODO: hpoint, matrix
 }
 
 
@@ -158,9 +428,9 @@ void Primitive::sample(float u1, float u2, float u3, int *primID, core::Vec3 *p,
     *n = objectToWorld_.transformNormal(*n);
 }
 
-float Primitive::pdf(const core::Vec3 &p) const
+float Primitive::pdf(int primID, const core::Vec3 &p) const
 {
-    return shape_->pdf(worldToObject_.transformPoint(p));
+    return shape_->pdf(primID, worldToObject_.transformPoint(p));
 }
 
 void Primitive::sample(const core::Vec3 &ps, float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const
@@ -170,9 +440,16 @@ void Primitive::sample(const core::Vec3 &ps, float u1, float u2, float u3, int *
     *n = objectToWorld_.transformNormal(*n);
 }
 
-float Primitive::pdf(const core::Vec3 &ps, const core::Vec3 &p, const core::Vec3 &n) const
+float Primitive::pdf(const core::Vec3 &ps, int primID, const core::Vec3 &p, const core::Vec3 &n) const
 {
-    return shape_->pdf(worldToObject_.transformPoint(ps), worldToObject_.transformPoint(p), worldToObject_.transformNormal(n));
+    return shape_->pdf(worldToObject_.transformPoint(ps), primID, worldToObject_.transformPoint(p), worldToObject_.transformNormal(n));
+}
+
+void Primitive::samplePrim(int primID, float u1, float u2, core::Vec3 *p, core::Vec3 *n) const
+{
+    shape_->samplePrim(primID, u1, u2, p, n);
+    *p = objectToWorld_.transformPoint(*p);
+    *n = objectToWorld_.transformNormal(*n);
 }
 
 }		// core
@@ -4,6 +4,7 @@
 #include <core/referenced.hpp>
 #include <core/shape.hpp>
 #include <OSL/oslexec.h>
+#include <vector>
 
 namespace paprika {
 namespace core {
@@ -43,8 +44,39 @@ public:
         return shaderToWorld_;
     }
 
+    // globals that fillIntersectionInfo only computes if the shader group
+    // reads them, P, Ng, I and the transforms are always filled in
+    enum GlobalsNeeded
+    {
+        NEEDS_UV = 1,
+        NEEDS_DPDUV = 2,
+        NEEDS_N = 4,
+        NEEDS_ALL = NEEDS_UV | NEEDS_DPDUV | NEEDS_N
+    };
+
+    // asks the shading system which globals the shader group reads, until
+    // then everything is computed
+    void queryGlobalsNeeded(OSL::ShadingSystem *shadingSystem);
+
+    int globalsNeeded() const
+    {
+        return globalsNeeded_;
+    }
+
+    // resolves the userdata the shader group reads against the parameters
+    // of the shape, picking an interpolation kernel for each of them
+    void prepareUserdata(OSL::ShadingSystem *shadingSystem);
+
+    // value of a parameter of the shape at the hit, in common space, followed
+    // by its derivatives if asked for
+    bool getUserdata(OSL::ustring name, OSL::TypeDesc type, const InterpolationInfo &interp, bool derivatives, void *val) const;
+
+    // fills in the shader globals for a ray known to hit primID
     void fillIntersectionInfo(const core::Ray &ray, int primID, core::InterpolationInfo *interp, OSL::ShaderGlobals *sg);
 
+    // fills in the shader globals for a hit found by embree
+    void fillIntersectionInfo(const core::Ray &ray, const core::RayHit &hit, core::InterpolationInfo *interp, OSL::ShaderGlobals *sg);
+
     void fillIntersectionInfo(const core::Vec3 &p, const core::Vec3 &n, int primID, core::InterpolationInfo *interp, OSL::ShaderGlobals *sg);
 
     bool isEmissive() const
@@ -52,12 +84,42 @@ public:
         return isEmissive_;
     }
 
+    // emission of lights whose shader doesn't vary over the surface, found
+    // once before rendering so that light samples don't need to run it
+    bool hasConstantEmission() const
+    {
+        return hasConstantEmission_;
+    }
+
+    const core::Color3 &constantEmission() const
+    {
+        return constantEmission_;
+    }
+
+    void setConstantEmission(const core::Color3 &Le)
+    {
+        hasConstantEmission_ = true;
+        constantEmission_ = Le;
+    }
+
+
+    core::BBox bounds() const
+    {
+        return shape_->bounds(objectToWorld_);
+    }
+
+    void normalCone(core::Vec3 *axis, float *cosTheta) const
+    {
+        shape_->normalCone(objectToWorld_, axis, cosTheta);
+    }
 
     void sample(float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const;
-    float pdf(const core::Vec3 &p) const;
+    float pdf(int primID, const core::Vec3 &p) const;
 
     void sample(const core::Vec3 &ps, float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const;
-    float pdf(const core::Vec3 &ps, const core::Vec3 &p, const core::Vec3 &n) const;
+    float pdf(const core::Vec3 &ps, int primID, const core::Vec3 &p, const core::Vec3 &n) const;
+
+    void samplePrim(int primID, float u1, float u2, core::Vec3 *p, core::Vec3 *n) const;
 
 
 #if 0
@@ -74,12 +136,32 @@ public:
 #endif
 
 private:
+    typedef void (*UserdataKernel)(const Primitive &primitive, const core::ParamItem &paramItem, const InterpolationInfo &interp, bool derivatives, void *val);
+
+    struct Userdata
+    {
+        OSL::ustring name;
+        OSL::TypeDesc type;
+        const core::ParamItem *paramItem;
+        UserdataKernel kernel;
+    };
+
+    static UserdataKernel userdataKernel(const core::ParamItem &paramItem);
+
     core::Shape *shape_;
     core::Transform objectToWorld_;
     core::Transform worldToObject_;
     OSL::ShaderGroupRef shaderGroup_;
     core::Transform shaderToWorld_;
     bool isEmissive_;
+    bool hasConstantEmission_;
+    core::Color3 constantEmission_;
+    int globalsNeeded_;
+
+    // a handful of entries, scanned linearly. userdata the shape doesn't
+    // have has no kernel.
+    std::vector<Userdata> userdata_;
+    bool hasUserdata_;      // any entry with a kernel
 };
 
 
@@ -85,6 +85,12 @@ Renderer::Renderer(core::Scene *scene, core::Camera *camera, OSL::ShaderGroupRef
     backgroundShaderGroup_ = backgroundShaderGroup;
     
     shadingSystem_ = shadingSystem;
+
+    for (std::size_t i = 0; i < scene_->primitives().size(); ++i)
+    {
+        scene_->primitives()[i]->queryGlobalsNeeded(shadingSystem_);
+        scene_->primitives()[i]->prepareUserdata(shadingSystem_);
+    }
 }
 
 Renderer::~Renderer()
@@ -203,19 +209,11 @@ bool Renderer::get_userdata(bool derivatives, OSL::ustring name, OSL::TypeDesc t
 {
     core::InterpolationInfo* interp = static_cast<core::InterpolationInfo*>(sg->renderstate);
 
-    const core::Shape *shape = interp->shape;
-
-    const core::ParamItem *paramItem = shape->getParamItem(name);
-
-    if (paramItem == NULL)
+    // backgrounds have no geometry to take userdata from
+    if (interp == NULL)
         return false;
 
-    if (paramItem->type.type != type)
-        return false;
-
-    shape->interpolate(*paramItem, *interp, derivatives, val);
-
-    return true;
+    return interp->primitive->getUserdata(name, type, *interp, derivatives, val);
 }
 
 }
@@ -0,0 +1,63 @@
+#include <core/sampler.hpp>
+#include <OpenImageIO/hash.h>
+
+namespace paprika {
+namespace core {
+
+Sampler::Sampler(uint32_t seed) :
+    seed_(seed),
+    x_(0), y_(0),
+    sampleIndex_(0),
+    dimension_(0)
+{
+
+}
+
+Sampler::~Sampler()
+{
+
+}
+
+void Sampler::startPixelSample(int x, int y, int sampleIndex, int dimension)
+{
+    x_ = x;
+    y_ = y;
+    sampleIndex_ = sampleIndex;
+    dimension_ = dimension;
+}
+
+uint32_t Sampler::hash(uint32_t a, uint32_t b, uint32_t c)
+{
+    return OIIO::bjhash::bjfinal(a, b, c);
+}
+
+uint32_t Sampler::hash(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    return OIIO::bjhash::bjfinal(OIIO::bjhash::bjfinal(a, b, c), d, 0x9e3779b9u);
+}
+
+uint32_t Sampler::reverseBits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+uint32_t Sampler::owenScramble(uint32_t x, uint32_t seed)
+{
+    // the Laine-Karras style permutation only propagates changes from the
+    // low bits to the high bits, so it is applied to the reversed bits
+    x = reverseBits(x);
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return reverseBits(x);
+}
+
+}		// core
+}		// paprika
@@ -0,0 +1,61 @@
+#ifndef CORE_SAMPLER_HPP
+#define CORE_SAMPLER_HPP
+
+#include <stdint.h>
+
+namespace paprika {
+namespace core {
+
+// A sampler hands out the random numbers of a single pixel sample one
+// dimension at a time. The values only depend on the pixel, the sample index,
+// the dimension and the seed, so every thread can own a clone of the sampler
+// and the rendered image doesn't depend on the order pixels are visited in.
+class Sampler
+{
+public:
+    Sampler(uint32_t seed);
+    virtual ~Sampler();
+
+    // starting at a later dimension continues a pixel sample whose first
+    // dimensions were already used, e.g. for the camera ray
+    virtual void startPixelSample(int x, int y, int sampleIndex, int dimension = 0);
+
+    // the next dimension that will be used
+    int dimension() const
+    {
+        return dimension_;
+    }
+
+    virtual float get1D() = 0;
+    virtual void get2D(float *u1, float *u2) = 0;
+
+    virtual Sampler *clone() const = 0;
+
+protected:
+    static uint32_t hash(uint32_t a, uint32_t b, uint32_t c);
+    static uint32_t hash(uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+
+    static uint32_t reverseBits(uint32_t x);
+
+    // hash based Owen scrambling of a 32 bit fixed point number in [0, 1),
+    // see Burley, "Practical Hash-based Owen Scrambling", JCGT 2020.
+    // Applied to a sample index, it shuffles the index while keeping every
+    // aligned power of two block of indices together.
+    static uint32_t owenScramble(uint32_t x, uint32_t seed);
+
+    // maps 32 random bits to a float in [0, 1)
+    static float toFloat(uint32_t bits)
+    {
+        return (bits >> 8) * (1.f / 16777216.f);
+    }
+
+    uint32_t seed_;
+    int x_, y_;
+    int sampleIndex_;
+    int dimension_;
+};
+
+}		// core
+}		// paprika
+
+#endif
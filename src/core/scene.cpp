@@ -10,7 +10,18 @@ Scene::Scene(RTCDevice device, const std::vector<core::Primitive*> &primitives)
     for (std::size_t i = 0; i < primitives_.size(); ++i)
         primitives_[i]->ref();
 
-	scene_ = rtcDeviceNewScene(device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+    RTCAlgorithmFlags flags = core::Shape::rtcAlgorithmFlags(device);
+
+	scene_ = rtcDeviceNewScene(device, RTC_SCENE_STATIC, flags);
+
+    if (flags & RTC_INTERSECT16)
+        packetSize_ = 16;
+    else if (flags & RTC_INTERSECT8)
+        packetSize_ = 8;
+    else if (flags & RTC_INTERSECT4)
+        packetSize_ = 4;
+    else
+        packetSize_ = 1;
 
     for (std::size_t i = 0; i < primitives_.size(); ++i)
     {
@@ -56,11 +67,129 @@ core::Primitive *Scene::intersect(const core::Ray &ray, core::InterpolationInfo
  
     core::Primitive *primitive = primitives_[ray2.instID];      // TODO bunu arastir
 
-    primitive->fillIntersectionInfo(ray, ray2.primID, interp, sg);
+    core::RayHit hit;
+    hit.primID = ray2.primID;
+    hit.t = ray2.tfar;
+    hit.u = ray2.u;
+    hit.v = ray2.v;
+
+    primitive->fillIntersectionInfo(ray, hit, interp, sg);
 
     return primitive;
 }
 
+static void rtcIntersectN(const int *valid, RTCScene scene, RTCRay4 &ray)
+{
+    rtcIntersect4(valid, scene, ray);
+}
+
+static void rtcIntersectN(const int *valid, RTCScene scene, RTCRay8 &ray)
+{
+    rtcIntersect8(valid, scene, ray);
+}
+
+static void rtcIntersectN(const int *valid, RTCScene scene, RTCRay16 &ray)
+{
+    rtcIntersect16(valid, scene, ray);
+}
+
+static void rtcOccludedN(const int *valid, RTCScene scene, RTCRay4 &ray)
+{
+    rtcOccluded4(valid, scene, ray);
+}
+
+static void rtcOccludedN(const int *valid, RTCScene scene, RTCRay8 &ray)
+{
+    rtcOccluded8(valid, scene, ray);
+}
+
+static void rtcOccludedN(const int *valid, RTCScene scene, RTCRay16 &ray)
+{
+    rtcOccluded16(valid, scene, ray);
+}
+
+// inactive lanes get a copy of the last ray, so that they don't widen the
+// traversal of the packet
+template <typename RTCRayN, int N>
+static void fillPacket(int count, const core::Ray *rays, int *valid, RTCRayN &packet)
+{
+    for (int i = 0; i < N; ++i)
+    {
+        valid[i] = i < count ? -1 : 0;
+
+        const core::Ray &ray = rays[std::min(i, count - 1)];
+
+        packet.orgx[i] = ray.o.val().x;
+        packet.orgy[i] = ray.o.val().y;
+        packet.orgz[i] = ray.o.val().z;
+
+        packet.dirx[i] = ray.d.val().x;
+        packet.diry[i] = ray.d.val().y;
+        packet.dirz[i] = ray.d.val().z;
+
+        packet.tnear[i] = ray.tnear;
+        packet.tfar[i] = ray.tfar;
+        packet.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+        packet.primID[i] = RTC_INVALID_GEOMETRY_ID;
+        packet.instID[i] = RTC_INVALID_GEOMETRY_ID;
+        packet.mask[i] = 0xFFFFFFFF;
+        packet.time[i] = 0.0f;
+    }
+}
+
+template <typename RTCRayN, int N>
+void Scene::intersectPacket(int count, const core::Ray *rays, core::Primitive **primitives, core::InterpolationInfo *interps, OSL::ShaderGlobals *sgs) const
+{
+    RTCRayN packet;
+    RTCORE_ALIGN(64) int valid[N];
+
+    fillPacket<RTCRayN, N>(count, rays, valid, packet);
+
+    rtcIntersectN(valid, scene_, packet);
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (packet.geomID[i] == RTC_INVALID_GEOMETRY_ID)
+        {
+            primitives[i] = NULL;
+            continue;
+        }
+
+        core::RayHit hit;
+        hit.primID = packet.primID[i];
+        hit.t = packet.tfar[i];
+        hit.u = packet.u[i];
+        hit.v = packet.v[i];
+
+        primitives[i] = primitives_[packet.instID[i]];
+        primitives[i]->fillIntersectionInfo(rays[i], hit, &interps[i], &sgs[i]);
+    }
+}
+
+void Scene::intersect(int count, const core::Ray *rays, core::Primitive **primitives, core::InterpolationInfo *interps, OSL::ShaderGlobals *sgs) const
+{
+    for (int i = 0; i < count; i += packetSize_)
+    {
+        int n = std::min(packetSize_, count - i);
+
+        switch (packetSize_)
+        {
+            case 16:
+                intersectPacket<RTCRay16, 16>(n, rays + i, primitives + i, interps + i, sgs + i);
+                break;
+            case 8:
+                intersectPacket<RTCRay8, 8>(n, rays + i, primitives + i, interps + i, sgs + i);
+                break;
+            case 4:
+                intersectPacket<RTCRay4, 4>(n, rays + i, primitives + i, interps + i, sgs + i);
+                break;
+            default:
+                primitives[i] = intersect(rays[i], &interps[i], &sgs[i]);
+                break;
+        }
+    }
+}
+
 bool Scene::isVisible(const core::Ray &ray) const
 {
     RTCRay ray2;
@@ -91,6 +220,49 @@ bool Scene::isVisible(const core::Vec3 &p1, const core::Vec3 &p2) const
     return isVisible(ray);
 }
 
+template <typename RTCRayN, int N>
+uint32_t Scene::occludedPacket(int count, const core::Ray *rays) const
+{
+    RTCRayN packet;
+    RTCORE_ALIGN(64) int valid[N];
+
+    fillPacket<RTCRayN, N>(count, rays, valid, packet);
+
+    rtcOccludedN(valid, scene_, packet);
+
+    uint32_t visible = 0;
+    for (int i = 0; i < count; ++i)
+        if (packet.geomID[i] == RTC_INVALID_GEOMETRY_ID)
+            visible |= 1u << i;
+
+    return visible;
+}
+
+void Scene::isVisible(int count, const core::Ray *rays, uint32_t *visible) const
+{
+    for (int i = 0; i < (count + 31) / 32; ++i)
+        visible[i] = 0;
+
+    // packet sizes divide 32, so a packet never spans two words of the mask
+    for (int i = 0; i < count; i += packetSize_)
+    {
+        int n = std::min(packetSize_, count - i);
+        uint32_t mask;
+
+        // a single ray is cheaper to trace on its own
+        if (n == 1)
+            mask = isVisible(rays[i]) ? 1u : 0u;
+        else if (packetSize_ == 16)
+            mask = occludedPacket<RTCRay16, 16>(n, rays + i);
+        else if (packetSize_ == 8)
+            mask = occludedPacket<RTCRay8, 8>(n, rays + i);
+        else
+            mask = occludedPacket<RTCRay4, 4>(n, rays + i);
+
+        visible[i / 32] |= mask << (i % 32);
+    }
+}
+
 
 #if 0
 class CScene : public core::CObject
@@ -2,6 +2,7 @@
 #define CORE_SCENE_H
 
 #include <vector>
+#include <stdint.h>
 #include <core/geometry.hpp>
 #include <core/shape.hpp>
 #include <core/referenced.hpp>
@@ -21,17 +22,33 @@ public:
 
     core::Primitive *intersect(const core::Ray &ray, core::InterpolationInfo *interp, OSL::ShaderGlobals *sg) const;
 
+    // intersects a batch of rays, using ray packets of the widest size
+    // supported by embree. coherent rays like camera rays benefit the most.
+    void intersect(int count, const core::Ray *rays, core::Primitive **primitives, core::InterpolationInfo *interps, OSL::ShaderGlobals *sgs) const;
+
     bool isVisible(const core::Ray &ray) const;
     bool isVisible(const core::Vec3 &p1, const core::Vec3 &p2) const;
 
+    // tests a batch of segments, given as rays between tnear and tfar, for
+    // occlusion with ray packets. bit i % 32 of visible[i / 32] is set if
+    // segment i is unoccluded, visible must hold (count + 31) / 32 words.
+    void isVisible(int count, const core::Ray *rays, uint32_t *visible) const;
+
     const std::vector<core::Primitive*> &primitives() const
     {
         return primitives_;
     }
 
 private:
+    template <typename RTCRayN, int N>
+    void intersectPacket(int count, const core::Ray *rays, core::Primitive **primitives, core::InterpolationInfo *interps, OSL::ShaderGlobals *sgs) const;
+
+    template <typename RTCRayN, int N>
+    uint32_t occludedPacket(int count, const core::Ray *rays) const;
+
     std::vector<core::Primitive*> primitives_;
     RTCScene scene_;
+    int packetSize_;
 };
 
 }
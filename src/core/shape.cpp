@@ -16,7 +16,27 @@ Shape::~Shape()
         free(freeList_[i]);
 }
 
-float Shape::pdf(const core::Vec3 &p) const
+RTCAlgorithmFlags Shape::rtcAlgorithmFlags(RTCDevice device)
+{
+    int flags = RTC_INTERSECT1;
+
+    if (rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT4))
+        flags |= RTC_INTERSECT4;
+    if (rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT8))
+        flags |= RTC_INTERSECT8;
+    if (rtcDeviceGetParameter1i(device, RTC_CONFIG_INTERSECT16))
+        flags |= RTC_INTERSECT16;
+
+    return (RTCAlgorithmFlags)flags;
+}
+
+void Shape::normalCone(const core::Transform &objectToWorld, core::Vec3 *axis, float *cosTheta) const
+{
+    *axis = core::Vec3(0.f, 0.f, 1.f);
+    *cosTheta = -1.f;
+}
+
+float Shape::pdf(int primID, const core::Vec3 &p) const
 {
     return 1.f / area();
 }
@@ -26,9 +46,9 @@ void Shape::sample(const core::Vec3 &ps, float u1, float u2, float u3, int *prim
     return sample(u1, u2, u3, primID, p, n);
 }
 
-float Shape::pdf(const core::Vec3 &ps, const core::Vec3 &p, const core::Vec3 &n) const
+float Shape::pdf(const core::Vec3 &ps, int primID, const core::Vec3 &p, const core::Vec3 &n) const
 {
-    float pdfArea = pdf(p);
+    float pdfArea = pdf(primID, p);
 
     core::Vec3 dir = ps - p;
 
@@ -41,6 +61,21 @@ float Shape::pdf(const core::Vec3 &ps, const core::Vec3 &p, const core::Vec3 &n)
     return pdfArea * length2 / dot;
 }
 
+int Shape::primCount() const
+{
+    return 1;
+}
+
+void Shape::samplePrim(int primID, float u1, float u2, core::Vec3 *p, core::Vec3 *n) const
+{
+    int unused;
+    sample(u1, u2, 0.f, &unused, p, n);
+}
+
+void Shape::setPrimWeights(const std::vector<float> &weights)
+{
+}
+
 void Shape::transferParameters(core::ParameterMap& map, int nConstant, int nPerPiece, int nLinear, int nVertex)
 {
 	for (ParameterMap::iterator iter = map.begin(); iter != map.end(); ++iter)
@@ -138,21 +173,26 @@ void Shape::interpolate(const core::ParamItem &paramitem, const InterpolationInf
 	{
 		case core::INTERP_CONSTANT:
 			memcpy(paramarea, paramitem.data, datasize);
+			if (derivatives)
+				memset(static_cast<char*>(paramarea) + datasize, 0, 2 * datasize);
 			break;
 		case core::INTERP_PERPIECE:
 			memcpy(paramarea, paramitem.data + interp.ipiece * datasize, datasize);
+			if (derivatives)
+				memset(static_cast<char*>(paramarea) + datasize, 0, 2 * datasize);
 			break;
 		case core::INTERP_LINEAR:
 		case core::INTERP_VERTEX:
 		{
 			float* farea = static_cast<float*>(paramarea);
             int nfloats = type.numelements() * type.aggregate;
-			
-			std::fill(farea, farea + nfloats, 0.f);
+
+			// the derivatives follow the value, as OSL lays them out
+			std::fill(farea, farea + (derivatives ? 3 * nfloats : nfloats), 0.f);
 
 			bool isvertex = paramitem.type.interp == core::INTERP_VERTEX;
 
-			for (std::size_t j = 0; j < interp.weights.size(); ++j)
+			for (int j = 0; j < interp.nweights; ++j)
 			{
 				const InterpolationInfo::Weight& w = interp.weights[j];
 
@@ -160,6 +200,15 @@ void Shape::interpolate(const core::ParamItem &paramitem, const InterpolationInf
 
 				for (int k = 0; k < nfloats; ++k)
 					farea[k] += floats[k] * w.weight.val();
+
+				if (derivatives)
+				{
+					for (int k = 0; k < nfloats; ++k)
+					{
+						farea[nfloats + k] += floats[k] * w.weight.dx();
+						farea[2 * nfloats + k] += floats[k] * w.weight.dy();
+					}
+				}
 			}
 
 			break;
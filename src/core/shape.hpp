@@ -15,6 +15,7 @@ namespace paprika {
 namespace core {
 
 class Shape;
+class Primitive;
 
 struct InterpolationInfo
 {
@@ -29,9 +30,23 @@ struct InterpolationInfo
 		int ilinear;
         OSL::Dual2<float> weight;
 	};
-	std::vector<Weight> weights; // indices and values of non-zero weights
+	// indices and values of non-zero weights, stored inline so that filling
+	// in a hit doesn't touch the heap
+	enum { MaxWeights = 3 };
+	Weight weights[MaxWeights];
+	int nweights;
 
     const Shape *shape;
+    const Primitive *primitive;
+    int primID;
+};
+
+// closest hit as reported by embree, t is along the ray and u, v are the
+// barycentric coordinates for triangles
+struct RayHit
+{
+    int primID;
+    float t, u, v;
 };
 
 struct HitInfo
@@ -48,7 +63,13 @@ public:
     Shape();
     virtual ~Shape();
 
-    virtual void fillHitInfo(const core::Ray &ray, int primID, core::HitInfo *hitInfo) const = 0;
+    // completes the hit found by embree for the object space ray. derivatives
+    // of u and v are only computed if asked for.
+    virtual void fillHitInfo(const core::Ray &ray, const core::RayHit &hit, bool derivatives, core::HitInfo *hitInfo) const = 0;
+
+    // intersects the object space ray with the primitive primID, for points
+    // that don't come from embree such as light samples
+    virtual void intersectPrim(const core::Ray &ray, int primID, core::RayHit *hit) const = 0;
 
     virtual void fillInterpolationInfo(const core::HitInfo &hitInfo, core::InterpolationInfo *interp) const = 0;
 
@@ -64,19 +85,42 @@ public:
 
 	virtual float area() const = 0;
 
+    // world space bounds of the shape
+    virtual core::BBox bounds(const core::Transform &objectToWorld) const = 0;
+
+    // cone that contains the world space geometric normals, cosTheta is the
+    // cosine of its half angle. the default is the whole sphere.
+    virtual void normalCone(const core::Transform &objectToWorld, core::Vec3 *axis, float *cosTheta) const;
+
     // area measure
     virtual void sample(float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const = 0;
-    virtual float pdf(const core::Vec3 &p) const;
+    virtual float pdf(int primID, const core::Vec3 &p) const;
 
     // solid angle measure
     virtual void sample(const core::Vec3 &ps, float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const;
-    virtual float pdf(const core::Vec3 &ps, const core::Vec3 &p, const core::Vec3 &n) const;
+    virtual float pdf(const core::Vec3 &ps, int primID, const core::Vec3 &p, const core::Vec3 &n) const;
+
+    // number of primitives, numbered as embree numbers them
+    virtual int primCount() const;
+
+    // uniformly samples a point on a single primitive
+    virtual void samplePrim(int primID, float u1, float u2, core::Vec3 *p, core::Vec3 *n) const;
+
+    // makes sample() pick primitives in proportion to their area times
+    // their weight, an empty vector restores area weighting. the weights
+    // belong to the shape, so a shape with weights can't be shared between
+    // primitives
+    virtual void setPrimWeights(const std::vector<float> &weights);
 
     RTCScene rtcScene() const
     {
         return scene_;
     }
 
+    // RTC_INTERSECT1 and the packet widths supported by the embree build
+    // and the cpu, the scenes of the shapes and the core::Scene must agree
+    static RTCAlgorithmFlags rtcAlgorithmFlags(RTCDevice device);
+
     const core::ParamItem *getParamItemN() const
     {
         return paramItemN_;
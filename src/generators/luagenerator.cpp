@@ -252,7 +252,13 @@ int LuaGenerator::mesh(lua_State *L)
 
 int LuaGenerator::background(lua_State *L)
 {
+    for (int i = 1; i < lua_gettop(L); i += 2)
+        parameter(L, i);
+
     api_->background();
+
+    clear();
+
     return 0;
 }
 
@@ -264,7 +270,13 @@ int LuaGenerator::input(lua_State *L)
 
 int LuaGenerator::render(lua_State *L)
 {
+    for (int i = 1; i < lua_gettop(L); i += 2)
+        parameter(L, i);
+
     api_->render();
+
+    clear();
+
     return 0;
 }
 
@@ -0,0 +1,154 @@
+#include <lights/environmentlight.hpp>
+#include <core/debug.hpp>
+#include <OpenImageIO/imageio.h>
+#include <algorithm>
+#include <cstring>
+
+namespace paprika {
+namespace light {
+
+EnvironmentLight::EnvironmentLight(const core::Transform &lightToWorld, Mapping mapping, int width, int height, const std::vector<core::Color3> &texels, float intensity) :
+    worldToLight_(lightToWorld.inverse()),
+    mapping_(mapping),
+    width_(width),
+    height_(height),
+    texels_(texels),
+    intensity_(intensity)
+{
+}
+
+EnvironmentLight *EnvironmentLight::create(const core::Transform &lightToWorld, core::ParameterMap &map)
+{
+    const char *filename = map.find("filename", OIIO::TypeDesc::STRING, (const char*)NULL);
+    const char *mappingName = map.find("mapping", OIIO::TypeDesc::STRING, "latlong");
+    float intensity = map.find("intensity", OIIO::TypeDesc::FLOAT, 1.f);
+    float rotation = map.find("rotation", OIIO::TypeDesc::FLOAT, 0.f);
+
+    if (filename == NULL)
+    {
+        core::Error("Cannot construct environment light without parameter \"filename\"");
+        return NULL;
+    }
+
+    Mapping mapping;
+    if (strcmp(mappingName, "latlong") == 0)
+        mapping = MAPPING_LATLONG;
+    else if (strcmp(mappingName, "mirrorball") == 0)
+        mapping = MAPPING_MIRRORBALL;
+    else
+    {
+        core::Error("Unrecognized environment mapping \"%s\". Using latlong mapping.", mappingName);
+        mapping = MAPPING_LATLONG;
+    }
+
+    OIIO::ImageInput *in = OIIO::ImageInput::open(filename);
+    if (in == NULL)
+    {
+        core::Error("Cannot open environment map \"%s\"", filename);
+        return NULL;
+    }
+
+    const OIIO::ImageSpec &spec = in->spec();
+    int width = spec.width;
+    int height = spec.height;
+    int nchannels = spec.nchannels;
+
+    std::vector<float> pixels(width * height * nchannels);
+    bool ok = in->read_image(OIIO::TypeDesc::FLOAT, &pixels[0]);
+    in->close();
+    delete in;
+
+    if (!ok)
+    {
+        core::Error("Cannot read environment map \"%s\"", filename);
+        return NULL;
+    }
+
+    // gray images are replicated to rgb, extra channels are dropped
+    std::vector<core::Color3> texels(width * height);
+    for (int i = 0; i < width * height; ++i)
+    {
+        const float *p = &pixels[i * nchannels];
+        texels[i] = nchannels >= 3 ? core::Color3(p[0], p[1], p[2]) : core::Color3(p[0], p[0], p[0]);
+    }
+
+    // rotation turns the map around its up axis
+    core::Transform lightToWorldRotated = core::Transform::rotate(rotation, 0.f, 0.f, 1.f) * lightToWorld;
+
+    return new EnvironmentLight(lightToWorldRotated, mapping, width, height, texels, intensity);
+}
+
+EnvironmentLight *EnvironmentLight::boxFiltered(int factor) const
+{
+    int width = std::max(1, width_ / factor);
+    int height = std::max(1, height_ / factor);
+
+    // the last row and column also take the texels left over by the division
+    std::vector<core::Color3> texels(width * height, core::Color3(0.f, 0.f, 0.f));
+    for (int y = 0; y < height_; ++y)
+    {
+        int ry = std::min(y / factor, height - 1);
+        for (int x = 0; x < width_; ++x)
+            texels[ry * width + std::min(x / factor, width - 1)] += texels_[y * width_ + x];
+    }
+
+    for (int ry = 0; ry < height; ++ry)
+    {
+        int rows = ry == height - 1 ? height_ - ry * factor : factor;
+        for (int rx = 0; rx < width; ++rx)
+        {
+            int columns = rx == width - 1 ? width_ - rx * factor : factor;
+            texels[ry * width + rx] /= float(rows * columns);
+        }
+    }
+
+    return new EnvironmentLight(worldToLight_.inverse(), mapping_, width, height, texels, intensity_);
+}
+
+core::Color3 EnvironmentLight::texel(int x, int y) const
+{
+    // longitude wraps around, the poles clamp
+    x %= width_;
+    if (x < 0)
+        x += width_;
+    y = std::min(std::max(y, 0), height_ - 1);
+
+    return texels_[y * width_ + x];
+}
+
+core::Color3 EnvironmentLight::eval(const core::Vec3 &dir) const
+{
+    core::Vec3 d = worldToLight_.transformVector(dir).normalized();
+
+    float s, t;
+    if (mapping_ == MAPPING_LATLONG)
+    {
+        s = atan2f(d.y, d.x) * (0.5f * F_INV_PI);
+        if (s < 0)
+            s += 1.f;
+        t = acosf(std::min(1.f, std::max(-1.f, d.z))) * F_INV_PI;
+    }
+    else
+    {
+        float radial = atan2f(-d.z, d.x);
+        float r = 0.5f * sinf(acosf(std::min(1.f, std::max(-1.f, d.y))) * 0.5f);
+        s = 0.5f + r * cosf(radial);
+        t = 0.5f - r * sinf(radial);
+    }
+
+    // bilinear filtering between the four nearest texel centers
+    float x = s * width_ - 0.5f;
+    float y = t * height_ - 0.5f;
+    int x0 = (int)floorf(x);
+    int y0 = (int)floorf(y);
+    float fx = x - x0;
+    float fy = y - y0;
+
+    core::Color3 c = (texel(x0, y0) * (1 - fx) + texel(x0 + 1, y0) * fx) * (1 - fy) +
+                     (texel(x0, y0 + 1) * (1 - fx) + texel(x0 + 1, y0 + 1) * fx) * fy;
+
+    return c * intensity_;
+}
+
+}		// light
+}		// paprika
@@ -0,0 +1,58 @@
+#ifndef LIGHTS_ENVIRONMENTLIGHT_HPP
+#define LIGHTS_ENVIRONMENTLIGHT_HPP
+
+#include <core/referenced.hpp>
+#include <core/geometry.hpp>
+#include <core/parametermap.hpp>
+#include <vector>
+
+namespace paprika {
+namespace light {
+
+// Environment light read from an image, looked up without running a
+// shader. In light space z is up. "latlong" maps longitude to s and the
+// angle from +z to t, "mirrorball" is the light probe mapping of the
+// matpreview envmap shader.
+class EnvironmentLight : public core::Referenced
+{
+public:
+    enum Mapping
+    {
+        MAPPING_LATLONG,
+        MAPPING_MIRRORBALL
+    };
+
+    EnvironmentLight(const core::Transform &lightToWorld, Mapping mapping, int width, int height, const std::vector<core::Color3> &texels, float intensity);
+
+    static EnvironmentLight *create(const core::Transform &lightToWorld, core::ParameterMap &map);
+
+    // bilinearly filtered radiance arriving from the world space direction
+    core::Color3 eval(const core::Vec3 &dir) const;
+
+    // a copy with the map reduced by factor on both axes, every texel of the
+    // copy is the average of the texels it covers
+    EnvironmentLight *boxFiltered(int factor) const;
+
+    int width() const
+    {
+        return width_;
+    }
+
+    int height() const
+    {
+        return height_;
+    }
+
+private:
+    core::Color3 texel(int x, int y) const;
+
+    core::Transform worldToLight_;
+    Mapping mapping_;
+    int width_, height_;
+    std::vector<core::Color3> texels_;
+    float intensity_;
+};
+
+}		// light
+}		// paprika
+#endif
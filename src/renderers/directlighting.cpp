@@ -1,12 +1,11 @@
 #include <renderers/directlighting.hpp>
 #include <core/primitive.hpp>
 #include <core/scene.hpp>
+#include <core/sampler.hpp>
 
 namespace paprika {
 namespace renderer {
 
-static OSL::Rng rng(time(NULL));
-
 DirectLighting::DirectLighting(core::Scene *scene, core::Camera *camera, OSL::ShaderGroupRef backgroundShaderGroup, OSL::ShadingSystem *shadingSystem) :
     Renderer(scene, camera, backgroundShaderGroup, shadingSystem)
 {
@@ -28,7 +27,7 @@ void DirectLighting::render()
 
 }
 
-core::Color3 DirectLighting::Li(OSL::ShadingContext *ctx, const core::Ray& ray)
+core::Color3 DirectLighting::Li(OSL::ShadingContext *ctx, core::Sampler &sampler, const core::Ray& ray)
 {
     core::InterpolationInfo interp;
     OSL::ShaderGlobals sg;
@@ -57,7 +56,12 @@ core::Color3 DirectLighting::Li(OSL::ShadingContext *ctx, const core::Ray& ray)
     if (nLights == 0)
         return core::Color3(0.f, 0.f, 0.f);
 
-    int lightNum = (int)(rng * nLights);
+    float uLight = sampler.get1D();
+    float uLightPos[3];
+    sampler.get2D(&uLightPos[0], &uLightPos[1]);
+    uLightPos[2] = sampler.get1D();
+
+    int lightNum = (int)(uLight * nLights);
     lightNum = std::min(lightNum, nLights - 1);
 
     core::Primitive *light = lights_[lightNum];
@@ -67,8 +71,8 @@ core::Color3 DirectLighting::Li(OSL::ShadingContext *ctx, const core::Ray& ray)
  
     int primIDLight;
     core::Vec3 pLight, nLight;
-    light->sample(sg.P, rng, rng, rng, &primIDLight, &pLight, &nLight);
-    float pdfLight = light->pdf(sg.P, pLight, nLight);
+    light->sample(sg.P, uLightPos[0], uLightPos[1], uLightPos[2], &primIDLight, &pLight, &nLight);
+    float pdfLight = light->pdf(sg.P, primIDLight, pLight, nLight);
 
     if (pdfLight == 0)
         return core::Color3();
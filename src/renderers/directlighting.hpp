@@ -11,6 +11,7 @@ namespace paprika {
 
 namespace core {
 class Primitive;
+class Sampler;
 }
 
 namespace renderer {
@@ -24,7 +25,7 @@ public:
     virtual void render();
 
 private:
-    core::Color3 Li(OSL::ShadingContext *ctx, const core::Ray& ray);
+    core::Color3 Li(OSL::ShadingContext *ctx, core::Sampler &sampler, const core::Ray& ray);
     // core::Color3 estimateDirect(OSL::ShadingContext *ctx,
     //                             const OSL::ShaderGlobals &sg,
     //                             OSL::CompositeBSDF &bsdf);
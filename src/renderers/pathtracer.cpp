@@ -4,33 +4,72 @@
 #include <core/scene.hpp>
 #include <OSL/shading.h>
 #include <OSL/sampling.h>
+#include <core/parametermap.hpp>
+#include <core/sampler.hpp>
+#include <core/memoryarena.hpp>
+#include <core/debug.hpp>
+#include <lights/environmentlight.hpp>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <limits>
 
 namespace paprika {
 namespace renderer {
 
-static OSL::Rng rng(time(NULL));
-
 struct EvalBackgroundData
 {
     OSL::ShadingSystem *shadingSystem;
-    OSL::ShadingContext *ctx;
+    std::vector<OSL::ShadingContext*> ctxs;      // one per thread
     OSL::ShaderGroupRef shaderGroup;
 };
 
-static core::Vec3 eval_background(const OSL::Dual2<core::Vec3> &dir, EvalBackgroundData *data)
+static core::Vec3 eval_background(const OSL::Dual2<core::Vec3> &dir, EvalBackgroundData *data, int thread)
 {
     OSL::ShaderGlobals sg;
     memset(&sg, 0, sizeof(OSL::ShaderGlobals));
     sg.I = dir.val();
     sg.dIdx = dir.dx();
     sg.dIdy = dir.dy();
-    data->shadingSystem->execute(data->ctx, *data->shaderGroup, sg);
+    data->shadingSystem->execute(data->ctxs[thread], *data->shaderGroup, sg);
     return OSL::process_background_closure(sg.Ci);
 }
 
-PathTracer::PathTracer(core::Scene *scene, core::Camera *camera, OSL::ShaderGroupRef backgroundShaderGroup, OSL::ShadingSystem *shadingSystem) : 
-    Renderer(scene, camera, backgroundShaderGroup, shadingSystem)
+static core::Vec3 eval_environment(const OSL::Dual2<core::Vec3> &dir, light::EnvironmentLight *environment, int /*thread*/)
+{
+    return environment->eval(dir.val());
+}
+
+PathTracer::PathTracer(core::Scene *scene, core::Camera *camera, core::Sampler *sampler, OSL::ShaderGroupRef backgroundShaderGroup, light::EnvironmentLight *environment, OSL::ShadingSystem *shadingSystem, core::ParameterMap &params) : 
+    Renderer(scene, camera, backgroundShaderGroup, shadingSystem),
+    environment_(environment),
+    sampler_(sampler)
 {
+    if (environment_)
+        environment_->ref();
+
+    threads_ = params.find("threads", OIIO::TypeDesc::INT, 0);
+    if (threads_ <= 0)
+        threads_ = std::max(1, (int)std::thread::hardware_concurrency());
+
+    tileSize_ = std::max(1, params.find("tilesize", OIIO::TypeDesc::INT, 32));
+
+    batchSize_ = 64;
+
+    // adaptive sampling is enabled by a positive noise threshold, otherwise
+    // every pixel gets the same number of samples
+    noiseThreshold_ = params.find("noisethreshold", OIIO::TypeDesc::FLOAT, 0.f);
+    if (noiseThreshold_ > 0)
+    {
+        minSamples_ = std::max(2, params.find("minsamples", OIIO::TypeDesc::INT, 16));
+        maxSamples_ = std::max(minSamples_, params.find("maxsamples", OIIO::TypeDesc::INT, 1024));
+    }
+    else
+    {
+        minSamples_ = std::max(1, params.find("samples", OIIO::TypeDesc::INT, 64));
+        maxSamples_ = minSamples_;
+    }
+
     for (std::size_t i = 0; i < scene_->primitives().size(); ++i)
     {
         core::Primitive *primitive = scene_->primitives()[i];
@@ -38,236 +77,452 @@ PathTracer::PathTracer(core::Scene *scene, core::Camera *camera, OSL::ShaderGrou
             lights_.push_back(primitive);
     }
 
-    if (backgroundShaderGroup_)
+    OSL::PerThreadInfo *threadInfo = shadingSystem_->create_thread_info();
+    OSL::ShadingContext *ctx = shadingSystem_->get_context(threadInfo);
+
+    // meshes with varying emission sample their bright triangles more often
+    bool emissionWeighting = params.find("emissionweighting", OIIO::TypeDesc::INT, 1) != 0;
+
+    std::vector<float> power(lights_.size());
+    for (std::size_t i = 0; i < lights_.size(); ++i)
+    {
+        if (isConstantEmitter(lights_[i]))
+        {
+            core::Vec3 p, n;
+            lights_[i]->samplePrim(0, 4.f / 9.f, 0.5f, &p, &n);
+            lights_[i]->setConstantEmission(evalEmitter(ctx, lights_[i], 0, p, n));
+        }
+
+        if (emissionWeighting && !lights_[i]->hasConstantEmission())
+            weightByEmission(ctx, lights_[i]);
+        else
+            lights_[i]->shape()->setPrimWeights(std::vector<float>());
+
+        power[i] = estimatePower(ctx, lights_[i]);
+    }
+
+    lightBVH_.build(lights_, power);
+
+    shadingSystem_->release_context(ctx);
+    shadingSystem_->destroy_thread_info(threadInfo);
+
+    if (environment_)
     {
+        // the table only needs to resolve the texels of the map
+        int resolution = params.find("backgroundresolution", OIIO::TypeDesc::INT, 0);
+        if (resolution <= 0)
+            resolution = std::min(std::max(environment_->width() / 2, environment_->height()), 2048);
+
+        // the table looks up a box filtered copy of the map at about its own
+        // resolution, so that every texel of the map, like a small sun,
+        // contributes to the table with one lookup per table texel
+        int factor = std::max(1, std::min(environment_->width(), environment_->height()) / resolution);
+        light::EnvironmentLight *filtered = environment_;
+        if (factor > 1)
+            filtered = environment_->boxFiltered(factor);
+        else
+            filtered->ref();
+
         background_ = new OSL::Background;
+        background_->prepare(resolution, threads_, eval_environment, filtered);
 
-        OSL::PerThreadInfo *threadInfo = shadingSystem_->create_thread_info();
-        OSL::ShadingContext *ctx = shadingSystem_->get_context(threadInfo);
+        filtered->unref();
+    }
+    else if (backgroundShaderGroup_)
+    {
+        // the resolution of the importance table, by default from the
+        // environment textures of the background shader
+        int resolution = params.find("backgroundresolution", OIIO::TypeDesc::INT, 0);
+        if (resolution <= 0)
+            resolution = backgroundResolution();
+
+        background_ = new OSL::Background;
 
         EvalBackgroundData data;
         data.shadingSystem = shadingSystem_;
-        data.ctx = ctx;
         data.shaderGroup = backgroundShaderGroup_;
 
-        background_->prepare(128, eval_background, &data);
+        std::vector<OSL::PerThreadInfo*> threadInfos(threads_);
+        data.ctxs.resize(threads_);
+        for (int i = 0; i < threads_; ++i)
+        {
+            threadInfos[i] = shadingSystem_->create_thread_info();
+            data.ctxs[i] = shadingSystem_->get_context(threadInfos[i]);
+        }
+
+        background_->prepare(resolution, threads_, eval_background, &data);
 
-        shadingSystem_->release_context(ctx);
-        shadingSystem_->destroy_thread_info(threadInfo);
+        for (int i = 0; i < threads_; ++i)
+        {
+            shadingSystem_->release_context(data.ctxs[i]);
+            shadingSystem_->destroy_thread_info(threadInfos[i]);
+        }
     }
     else
         background_ = NULL;
 }
 
-PathTracer::~PathTracer()
+int PathTracer::backgroundResolution() const
 {
-    delete background_;
+    // procedural backgrounds are smooth enough for a coarse table
+    int resolution = 128;
+
+    int nTextures = 0;
+    OSL::ustring *textures = NULL;
+    shadingSystem_->getattribute(backgroundShaderGroup_.get(), "num_textures_needed", OIIO::TypeDesc::TypeInt, &nTextures);
+    shadingSystem_->getattribute(backgroundShaderGroup_.get(), "textures_needed", OIIO::TypeDesc::PTR, &textures);
+
+    OIIO::TextureSystem *textureSystem = shadingSystem_->texturesys();
+
+    for (int i = 0; textures != NULL && textureSystem != NULL && i < nTextures; ++i)
+    {
+        // a lat-long map has twice as many texels around the equator as the
+        // table has, the table spreads its rows evenly over the sphere
+        int size[2];
+        if (textureSystem->get_texture_info(textures[i], 0, OIIO::ustring("resolution"), OIIO::TypeDesc(OIIO::TypeDesc::INT, 2), size))
+            resolution = std::max(resolution, std::max(size[0] / 2, size[1]));
+    }
+
+    // 2048^2 texels take about 100 MB
+    return std::min(resolution, 2048);
 }
 
-static float powerHeuristic(float a, float b)
+bool PathTracer::isConstantEmitter(const core::Primitive *light) const
 {
-    return (a * a) / (a * a + b * b);
+    OSL::ShaderGroup *group = light->shaderGroup().get();
+
+    // userdata and attributes can differ between points of the light
+    int nUserdata = 0, nAttributes = 0, unknownAttributes = 1;
+    if (!shadingSystem_->getattribute(group, "num_userdata", OIIO::TypeDesc::TypeInt, &nUserdata) ||
+        !shadingSystem_->getattribute(group, "num_attributes_needed", OIIO::TypeDesc::TypeInt, &nAttributes) ||
+        !shadingSystem_->getattribute(group, "unknown_attributes_needed", OIIO::TypeDesc::TypeInt, &unknownAttributes))
+        return false;
+
+    if (nUserdata != 0 || nAttributes != 0 || unknownAttributes != 0)
+        return false;
+
+    int nGlobals = 0;
+    OSL::ustring *globals = NULL;
+    if (!shadingSystem_->getattribute(group, "num_globals_needed", OIIO::TypeDesc::TypeInt, &nGlobals) ||
+        !shadingSystem_->getattribute(group, "globals_needed", OIIO::TypeDesc::PTR, &globals))
+        return false;
+
+    // the surface area is the same everywhere on the primitive, any other
+    // global read by the group makes the emission vary
+    for (int i = 0; i < nGlobals; ++i)
+    {
+        if (globals[i] != "surfacearea" && globals[i] != "Ci")
+            return false;
+    }
+
+    return true;
 }
 
-core::Color3 PathTracer::estimateDirect(OSL::ShadingContext *ctx,
-                                        const OSL::ShaderGlobals &sg,
-                                        OSL::CompositeBSDF &bsdf)
+core::Color3 PathTracer::evalEmitter(OSL::ShadingContext *ctx, core::Primitive *light, int primID, const core::Vec3 &p, const core::Vec3 &n)
 {
-    int nLights = lights_.size();
+    core::InterpolationInfo interp;
+    OSL::ShaderGlobals sg;
+    memset(&sg, 0, sizeof(OSL::ShaderGlobals));
+    light->fillIntersectionInfo(p, n, primID, &interp, &sg);
 
-    if (background_)
-        nLights++;
+    shadingSystem_->execute(ctx, *light->shaderGroup(), sg);
+    OSL::ShadingResult result;
+    OSL::process_closure(result, sg.Ci, true);
 
-    if (nLights == 0)
-        return core::Color3(0.f, 0.f, 0.f);
+    return result.Le;
+}
 
-    int lightNum = (int)(rng * nLights);
-    lightNum = std::min(lightNum, nLights - 1);
+static float average(const core::Color3 &c)
+{
+    return (c.x + c.y + c.z) * (1.f / 3.f);
+}
 
-    core::Primitive *light;
-    if (background_ && lightNum == nLights - 1)
-        light = NULL;
-    else
-        light = lights_[lightNum];
+float PathTracer::estimatePower(OSL::ShadingContext *ctx, core::Primitive *light)
+{
+    // emission over a stratified grid of points on the light, divided by
+    // the pdf so that it doesn't matter how the light distributes them
+    const int n = 4;
 
-    float pdfLightSelect = 1.f / nLights;
+    float sum = 0.f;
+    for (int i = 0; i < n * n; ++i)
+    {
+        float u1 = ((i % n) + 0.5f) / n;
+        float u2 = ((i / n) + 0.5f) / n;
+        float u3 = (i + 0.5f) / (n * n);
 
-    core::Color3 Ld(0.f, 0.f, 0.f);
+        int primID;
+        core::Vec3 p, normal;
+        light->sample(u1, u2, u3, &primID, &p, &normal);
 
-    if (light == NULL)
-    {
-        // sample background
-        do
-        {
-            OSL::Dual2<core::Vec3> wi;
-            float invpdf;
-            core::Color3 Le = background_->sample(rng, rng, wi, invpdf);
+        float pdf = light->pdf(primID, p);
+        if (pdf > 0)
+            sum += average(evalEmitter(ctx, light, primID, p, normal)) / pdf;
+    }
 
-            if (invpdf == 0 || Le == core::Color3(0, 0, 0))
-                break;
+    return sum / (n * n) * F_PI;
+}
 
-            float pdfLight = pdfLightSelect / invpdf;
+void PathTracer::weightByEmission(OSL::ShadingContext *ctx, core::Primitive *light)
+{
+    int count = light->shape()->primCount();
 
-            float pdfBsdf;
-            core::Color3 f = bsdf.eval(sg, wi.val(), pdfBsdf);
+    if (count <= 1)
+        return;
 
-            if (f == core::Color3(0, 0, 0))
-                break;
+    // the weights are stored in the shape, which must belong to this light
+    // alone
+    Assert(light->shape()->refCount() == 1);
 
-            if (!scene_->isVisible(core::Ray(sg.P, wi)))
-                break;
+    // emission averaged over a stratified grid of points on each primitive
+    const int n = 2;
 
-            float weight = powerHeuristic(pdfLight, pdfBsdf);
-            Ld += (f * Le) * (weight / pdfLight);
-        } while (0);
-    }
-    else
+    std::vector<float> weights(count);
+    float sum = 0.f;
+    for (int i = 0; i < count; ++i)
     {
-        // sample light
-        do
+        float emission = 0.f;
+        for (int j = 0; j < n * n; ++j)
         {
-            int primIDLight;
-            core::Vec3 pLight, nLight;
-            light->sample(sg.P, rng, rng, rng, &primIDLight, &pLight, &nLight);
-            float pdfLight = light->pdf(sg.P, pLight, nLight);
+            core::Vec3 p, normal;
+            light->samplePrim(i, ((j % n) + 0.5f) / n, ((j / n) + 0.5f) / n, &p, &normal);
+            emission += average(evalEmitter(ctx, light, i, p, normal));
+        }
 
-            if (pdfLight == 0)
-                break;
+        weights[i] = emission / (n * n);
+        sum += weights[i];
+    }
 
-            pdfLight *= pdfLightSelect;
+    // the points can miss small bright features, so no primitive is left
+    // without samples
+    float lowest = sum / count * 1e-2f;
+    for (int i = 0; i < count; ++i)
+        weights[i] = std::max(weights[i], lowest);
 
-            core::InterpolationInfo interpLight;
-            OSL::ShaderGlobals sgLight;
-            light->fillIntersectionInfo(pLight, nLight, primIDLight, &interpLight, &sgLight);
+    light->shape()->setPrimWeights(weights);
+}
 
-            core::Vec3 wi = (sgLight.P - sg.P).normalized();
+PathTracer::~PathTracer()
+{
+    delete sampler_;
+    delete background_;
 
-            if (wi.dot(sgLight.Ng) >= 0)
-                break;
+    if (environment_)
+        environment_->unref();
+}
 
-            shadingSystem_->execute(ctx, *light->shaderGroup(), sgLight);
-            OSL::ShadingResult resultLight;
-            OSL::process_closure(resultLight, sgLight.Ci, true);
+static float powerHeuristic(float a, float b)
+{
+    return (a * a) / (a * a + b * b);
+}
 
-            core::Color3 Le = resultLight.Le;
+// widest spread angle given to the ray cone of a diffuse or glossy bounce
+static const float maxConeSpread = 0.25f;
 
-            if (Le == core::Color3(0, 0, 0))
-                break;
+// angle between the ray and its differential rays, per pixel of the camera
+static float raySpread(const core::Ray &ray)
+{
+    float length = ray.d.val().length();
+    if (!(length > 0))
+        return 0.f;
 
-            float pdfBsdf;
-            core::Color3 f = bsdf.eval(sg, wi, pdfBsdf);
+    return std::max(ray.d.dx().length(), ray.d.dy().length()) / length;
+}
 
-            if (f == core::Color3(0, 0, 0))
-                break;
+// spread of the cone whose solid angle is the one a direction sampled with
+// the pdf stands for
+static float lobeSpread(float pdf)
+{
+    if (!(pdf > 0))
+        return maxConeSpread;
 
-            if (!scene_->isVisible(sg.P, sgLight.P))
-                break;
+    return std::min(1.f / sqrtf(float(M_PI) * pdf), maxConeSpread);
+}
+
+float PathTracer::lightPdf(const core::Vec3 &p, const core::Vec3 &n, const core::Primitive *light) const
+{
+    // the background and the light hierarchy are picked with equal
+    // probability when both exist
+    float pdfBackground = background_ ? (lightBVH_.empty() ? 1.f : 0.5f) : 0.f;
+
+    if (light == NULL)
+        return pdfBackground;
+
+    return (1 - pdfBackground) * lightBVH_.pmf(p, n, light);
+}
+
+void PathTracer::estimateDirect(OSL::ShadingContext *ctx,
+                                core::Sampler &sampler,
+                                const OSL::ShaderGlobals &sg,
+                                OSL::CompositeBSDF &bsdf,
+                                ShadowRay &shadowRay)
+{
+    // all dimensions are drawn up front, so that every bounce consumes the
+    // same number of dimensions no matter which branches are taken below
+    float uLight = sampler.get1D();
+    float uLightPos[3];
+    sampler.get2D(&uLightPos[0], &uLightPos[1]);
+    uLightPos[2] = sampler.get1D();
 
-            float weight = powerHeuristic(pdfLight, pdfBsdf);
-            Ld += (f * Le) * (weight / pdfLight);
-        } while (0);
+    shadowRay.L = core::Color3(0.f, 0.f, 0.f);
+
+    // pick the background or a light from the hierarchy, reusing uLight
+    float pdfBackground = lightPdf(sg.P, sg.N, NULL);
+
+    core::Primitive *light = NULL;
+    float pdfLightSelect;
+
+    if (uLight < pdfBackground)
+        pdfLightSelect = pdfBackground;
+    else
+    {
+        float u = std::min((uLight - pdfBackground) / (1 - pdfBackground), 0.99999994f);
+        light = lightBVH_.sample(sg.P, sg.N, u, &pdfLightSelect);
+
+        if (light == NULL)
+            return;
+
+        pdfLightSelect *= 1 - pdfBackground;
     }
 
-    // sample bsdf
-    do
+    if (light == NULL)
     {
+        // sample background
         OSL::Dual2<core::Vec3> wi;
-        float invpdf;
-        bsdf.sample(sg, rng, rng, rng, wi, invpdf);
+        float pdfLight;
+        core::Color3 Le = background_->sample(uLightPos[0], uLightPos[1], wi, pdfLight);
 
-        if (invpdf == 0)
-            break;
+        // the environment map is looked up exactly, the table only guides
+        // the sampling
+        if (environment_ && pdfLight != 0)
+            Le = environment_->eval(wi.val());
+
+        if (pdfLight == 0 || Le == core::Color3(0, 0, 0))
+            return;
+
+        pdfLight *= pdfLightSelect;
 
         float pdfBsdf;
         core::Color3 f = bsdf.eval(sg, wi.val(), pdfBsdf);
 
-        if (pdfBsdf == 0 || f == core::Color3(0, 0, 0))
-            break;
+        if (f == core::Color3(0, 0, 0))
+            return;
 
-        core::InterpolationInfo interpLight;
-        OSL::ShaderGlobals sgLight;
-        core::Primitive *primitive = scene_->intersect(core::Ray(sg.P, wi), &interpLight, &sgLight);
-        
-        if (primitive == NULL)
-        {
-            // evaluate background
-            if (!background_)
-                break;
+        // the bsdf returns f * cos / pdf
+        float weight = powerHeuristic(pdfLight, pdfBsdf);
+        shadowRay.ray = core::Ray(sg.P, wi);
+        shadowRay.L = (f * Le) * (pdfBsdf * weight / pdfLight);
+    }
+    else
+    {
+        // sample light
+        int primIDLight;
+        core::Vec3 pLight, nLight;
+        light->sample(sg.P, uLightPos[0], uLightPos[1], uLightPos[2], &primIDLight, &pLight, &nLight);
+        float pdfLight = light->pdf(sg.P, primIDLight, pLight, nLight);
 
-            float pdfLight;
-            core::Color3 Le = background_->eval(wi.val(), pdfLight);
+        if (pdfLight == 0)
+            return;
 
-            if (pdfLight == 0)
-                break;
+        pdfLight *= pdfLightSelect;
 
-            pdfLight *= pdfLightSelect;
+        core::Color3 Le;
 
-            float weight = powerHeuristic(pdfBsdf, pdfLight);
-            Ld += (f * Le) * (weight / pdfBsdf);
+        if (light->hasConstantEmission())
+        {
+            // the normal of the sample faces the same way as the geometric
+            // normal the shader would see
+            if ((pLight - sg.P).dot(nLight) >= 0)
+                return;
+
+            Le = light->constantEmission();
         }
         else
         {
-            // evaluate light
-            if (!primitive->isEmissive())
-                break;
-
-            if (sgLight.backfacing)
-                break;
-
-            float pdfLight = light->pdf(sg.P, sgLight.P, sgLight.Ng);
-
-            if (pdfLight == 0)
-                break;
+            core::InterpolationInfo interpLight;
+            OSL::ShaderGlobals sgLight;
+            light->fillIntersectionInfo(pLight, nLight, primIDLight, &interpLight, &sgLight);
 
-            pdfLight *= pdfLightSelect;
+            if ((sgLight.P - sg.P).dot(sgLight.Ng) >= 0)
+                return;
 
             shadingSystem_->execute(ctx, *light->shaderGroup(), sgLight);
             OSL::ShadingResult resultLight;
             OSL::process_closure(resultLight, sgLight.Ci, true);
 
-            float weight = powerHeuristic(pdfBsdf, pdfLight);
-            Ld += (f * resultLight.Le) * (weight / pdfBsdf);
+            Le = resultLight.Le;
+            pLight = sgLight.P;
         }
-    } while (0);
 
-    return Ld;
+        core::Vec3 wi = (pLight - sg.P).normalized();
+
+        if (Le == core::Color3(0, 0, 0))
+            return;
+
+        float pdfBsdf;
+        core::Color3 f = bsdf.eval(sg, wi, pdfBsdf);
+
+        if (f == core::Color3(0, 0, 0))
+            return;
+
+        float weight = powerHeuristic(pdfLight, pdfBsdf);
+        shadowRay.ray = core::Ray(sg.P, pLight - sg.P, 1e-3f, 1 - 1e-3f);
+        shadowRay.L = (f * Le) * (pdfBsdf * weight / pdfLight);
+    }
+}
+
+core::Color3 PathTracer::evalEmission(const core::Ray &ray,
+                                      const BsdfSample &bsdfSample,
+                                      const core::Primitive *primitive,
+                                      const core::InterpolationInfo &interp,
+                                      const OSL::ShaderGlobals &sg,
+                                      const core::Color3 &Le) const
+{
+    // camera rays and specular bounces can't be matched by light sampling
+    if (bsdfSample.pdf == std::numeric_limits<float>::infinity())
+        return Le;
+
+    if (!primitive->isEmissive() || sg.backfacing || Le == core::Color3(0, 0, 0))
+        return core::Color3(0.f, 0.f, 0.f);
+
+    const core::Vec3 &p = ray.o.val();
+    float pdfLight = lightPdf(p, bsdfSample.N, primitive);
+
+    if (pdfLight > 0)
+        pdfLight *= primitive->pdf(p, interp.primID, sg.P, sg.Ng);
+
+    return Le * powerHeuristic(bsdfSample.pdf, pdfLight);
 }
 
-core::Color3 PathTracer::Li(OSL::ShadingContext *ctx, float x, float y)
+core::Color3 PathTracer::Li(OSL::ShadingContext *ctx,
+                            core::Sampler &sampler,
+                            const core::Ray &cameraRay,
+                            core::Primitive *primitive,
+                            core::InterpolationInfo &interp,
+                            OSL::ShaderGlobals &sg)
 {
     core::Color3 pathThroughput(1.f, 1.f, 1.f);
     core::Color3 L(0.f, 0.f, 0.f);
 
-    core::CameraSample sample = { x + rng, y + rng, 0.f, 0.f, 0.f };
-    core::Ray ray;
-    camera_->generateRay(sample, &ray);
+    core::Ray ray = cameraRay;
 
-    bool specular = false;
+    // emission found by the camera ray is counted fully
+    BsdfSample bsdfSample;
+    bsdfSample.pdf = std::numeric_limits<float>::infinity();
 
     for (int bounces = 0; ; ++bounces)
     {
-        core::InterpolationInfo interp;
-        OSL::ShaderGlobals sg;
-        memset(&sg, 0, sizeof(sg));
-        core::Primitive *primitive = scene_->intersect(ray, &interp, &sg);
+        // the camera ray is intersected by the caller, later rays are the
+        // bsdf samples of the previous vertex
+        if (bounces > 0)
+        {
+            memset(&sg, 0, sizeof(sg));
+            primitive = scene_->intersect(ray, &interp, &sg);
+        }
 
         // evaluate background
         if (primitive == NULL)
         {
-            if (bounces == 0 || specular)
-            {
-                if (backgroundShaderGroup_)
-                {
-                    OSL::ShaderGlobals sg;
-                    memset(&sg, 0, sizeof(OSL::ShaderGlobals));
-                    sg.I = ray.d.val();
-                    sg.dIdx = ray.d.dx();
-                    sg.dIdy = ray.d.dy();
-                    shadingSystem_->execute(ctx, *backgroundShaderGroup_, sg);
-                    L += pathThroughput * OSL::process_background_closure(sg.Ci);
-                }
-            }
-
+            L += pathThroughput * evalBackground(ctx, ray, bsdfSample);
             break;
         }
 
@@ -279,75 +534,420 @@ core::Color3 PathTracer::Li(OSL::ShadingContext *ctx, float x, float y)
         // build internal pdf for sampling between bsdf closures
         result.bsdf.prepare(sg, core::Color3(1, 1, 1), false);
 
-        if (bounces == 0 || specular)
-            L += pathThroughput * result.Le;
+        // emission, weighted against light sampling at the previous vertex
+        L += pathThroughput * evalEmission(ray, bsdfSample, primitive, interp, sg, result.Le);
 
         OSL::CompositeBSDF &bsdf = result.bsdf;
 
         // sample illumination from lights to find path contribution
-        L += pathThroughput * estimateDirect(ctx, sg, bsdf);
+        ShadowRay shadowRay;
+        estimateDirect(ctx, sampler, sg, bsdf, shadowRay);
 
-        // sample BSDF to get new path direction
-        OSL::Dual2<core::Vec3> wi;
-        float invpdf;
-        pathThroughput *= bsdf.sample(sg, rng, rng, rng, wi, invpdf);
+        uint32_t visible = 0;
+        if (shadowRay.L != core::Color3(0, 0, 0))
+            scene_->isVisible(1, &shadowRay.ray, &visible);
+
+        if (visible)
+            L += pathThroughput * shadowRay.L;
+
+        if (!continuePath(sampler, sg, bsdf, bounces, pathThroughput, bsdfSample, ray))
+            break;
+    }
+
+    return L;
+}
+
+bool PathTracer::continuePath(core::Sampler &sampler,
+                              const OSL::ShaderGlobals &sg,
+                              const OSL::CompositeBSDF &bsdf,
+                              int bounces,
+                              core::Color3 &pathThroughput,
+                              BsdfSample &bsdfSample,
+                              core::Ray &ray)
+{
+    float uBsdf[3];
+    sampler.get2D(&uBsdf[0], &uBsdf[1]);
+    uBsdf[2] = sampler.get1D();
+    float uRoulette = sampler.get1D();
+
+    // sample BSDF to get new path direction
+    OSL::Dual2<core::Vec3> wi;
+    pathThroughput *= bsdf.sample(sg, uBsdf[0], uBsdf[1], uBsdf[2], wi, bsdfSample.pdf);
+    bsdfSample.N = sg.N;
+
+    if (!(pathThroughput.x > 0) && !(pathThroughput.y > 0) && !(pathThroughput.z > 0))
+        return false;
+
+    // specular lobes carry the differentials of the incoming ray over, the
+    // others leave those of wi at zero. the new ray gets a cone as wide as
+    // the incoming one or the lobe, whichever is wider, so that textures seen
+    // through diffuse and glossy bounces are filtered at a coarser MIP level
+    // rather than sampled at the finest one.
+    if (bsdfSample.pdf != std::numeric_limits<float>::infinity())
+    {
+        float spread = std::max(raySpread(ray), lobeSpread(bsdfSample.pdf));
+        OSL::TangentFrame frame(wi.val());
+        wi = OSL::Dual2<core::Vec3>(wi.val(), frame.get(spread, 0.f, 0.f), frame.get(0.f, spread, 0.f));
+    }
+
+    ray = core::Ray(OSL::Dual2<core::Vec3>(sg.P, sg.dPdx, sg.dPdy), wi);
+
+    // possibly terminate the path
+    if (bounces > 3)
+    {
+        float continueProbability = std::min(0.5f, pathThroughput.length());
+        if (uRoulette > continueProbability)
+            return false;
+        pathThroughput /= continueProbability;
+    }
+
+    return true;
+}
+
+core::Color3 PathTracer::evalBackground(OSL::ShadingContext *ctx, const core::Ray &ray, const BsdfSample &bsdfSample)
+{
+    if (!background_)
+        return core::Color3(0.f, 0.f, 0.f);
+
+    // bsdf samples are weighted against background sampling, which uses the
+    // tabulated background on both sides unless the environment map can be
+    // looked up directly
+    if (bsdfSample.pdf != std::numeric_limits<float>::infinity())
+    {
+        float pdfLight;
+        core::Color3 Le = background_->eval(ray.d.val(), pdfLight);
+
+        if (environment_)
+            Le = environment_->eval(ray.d.val());
+
+        // directions the table never picks are left to bsdf sampling alone
+        if (pdfLight == 0)
+            return Le;
+
+        return Le * powerHeuristic(bsdfSample.pdf, lightPdf(ray.o.val(), bsdfSample.N, NULL) * pdfLight);
+    }
+
+    // escaping camera and specular rays skip the shading system entirely
+    // with an environment map
+    if (environment_)
+        return environment_->eval(ray.d.val());
+
+    OSL::ShaderGlobals sg;
+    memset(&sg, 0, sizeof(OSL::ShaderGlobals));
+    sg.I = ray.d.val();
+    sg.dIdx = ray.d.dx();
+    sg.dIdy = ray.d.dy();
+    shadingSystem_->execute(ctx, *backgroundShaderGroup_, sg);
+    return OSL::process_background_closure(sg.Ci);
+}
+
+int PathTracer::startSample(core::Sampler &sampler, const PixelSample &sample, core::Ray *ray) const
+{
+    sampler.startPixelSample(sample.x, sample.y, sample.index);
+
+    float dx, dy;
+    sampler.get2D(&dx, &dy);
+
+    core::CameraSample cameraSample = { sample.x + dx, sample.y + dy, 0.f, 0.f, 0.f };
+    camera_->generateRay(cameraSample, ray);
+
+    return sampler.dimension();
+}
+
+void PathTracer::traceSamples(OSL::ShadingContext *ctx, core::Sampler &sampler, core::MemoryArena &arena, int count, const PixelSample *samples, core::Color3 *L)
+{
+    // camera rays are traced together, so that the scene can intersect them
+    // as coherent packets
+    core::Ray *rays = arena.alloc<core::Ray>(count);
+    core::Primitive **primitives = arena.alloc<core::Primitive*>(count);
+    core::InterpolationInfo *interps = arena.alloc<core::InterpolationInfo>(count);
+    OSL::ShaderGlobals *sgs = arena.alloc<OSL::ShaderGlobals>(count);
+    int *dimensions = arena.alloc<int>(count);
+
+    for (int i = 0; i < count; ++i)
+    {
+        dimensions[i] = startSample(sampler, samples[i], &rays[i]);
+        memset(&sgs[i], 0, sizeof(OSL::ShaderGlobals));
+    }
+
+    scene_->intersect(count, rays, primitives, interps, sgs);
+
+    for (int i = 0; i < count; ++i)
+    {
+        // continue after the camera dimensions
+        sampler.startPixelSample(samples[i].x, samples[i].y, samples[i].index, dimensions[i]);
+        L[i] = Li(ctx, sampler, rays[i], primitives[i], interps[i], sgs[i]);
+    }
+}
+
+struct PathTracer::PixelState
+{
+    core::Color3 sum;
+
+    // running mean and sum of squared differences of the luminance
+    float mean;
+    float m2;
+
+    int samples;
+    bool converged;
+};
+
+struct PathTracer::RenderState
+{
+    std::vector<Tile> tiles;
+    std::vector<PixelState> pixels;
+
+    // tiles that still have unconverged pixels, rendered in the current pass
+    std::vector<int> activeTiles;
+    int firstSample, lastSample;
+
+    std::atomic<int> nextTile;
+    std::atomic<int> tilesDone;
+    std::mutex progressMutex;
+    int progress;
+};
+
+// what a worker keeps over the passes, so that its buffers and the heap of
+// its shading context only grow during the first tiles
+struct PathTracer::ThreadState
+{
+    OSL::PerThreadInfo *threadInfo;     // keeps the released context for the next pass
+    OSL::ShadingContext *ctx;
+    core::Sampler *sampler;
+    int tiles;                          // rendered by the thread in all passes
+
+    core::MemoryArena arena;
+    std::vector<int> active;
+    std::vector<PixelSample> samples;
+    std::vector<core::Color3> L;
+};
+
+bool PathTracer::renderTile(ThreadState &thread, const Tile &tile, PixelState *pixels, int firstSample, int lastSample)
+{
+    int width = tile.x1 - tile.x0;
+
+    std::vector<int> &active = thread.active;
+    active.clear();
+    for (int i = 0; i < (tile.x1 - tile.x0) * (tile.y1 - tile.y0); ++i)
+    {
+        if (!pixels[i].converged)
+            active.push_back(i);
+    }
+
+    int batchSize = std::min((int)active.size(), batchSize_);
+    std::vector<PixelSample> &samples = thread.samples;
+    std::vector<core::Color3> &L = thread.L;
+
+    for (int i = firstSample; i < lastSample; ++i)
+    {
+        for (std::size_t b = 0; b < active.size(); b += batchSize)
+        {
+            int count = std::min(batchSize, (int)(active.size() - b));
+
+            for (int j = 0; j < count; ++j)
+            {
+                samples[j].x = tile.x0 + active[b + j] % width;
+                samples[j].y = tile.y0 + active[b + j] / width;
+                samples[j].index = i;
+            }
+
+            thread.arena.reset();
+            traceSamples(thread.ctx, *thread.sampler, thread.arena, count, &samples[0], &L[0]);
+
+            for (int j = 0; j < count; ++j)
+            {
+                const core::Color3 &c = L[j];
+
+                PixelState &pixel = pixels[active[b + j]];
+
+                pixel.sum += c;
+
+                // Welford's online variance update
+                float lum = (c.x + c.y + c.z) * (1.f / 3.f);
+                pixel.samples++;
+                float delta = lum - pixel.mean;
+                pixel.mean += delta / pixel.samples;
+                pixel.m2 += delta * (lum - pixel.mean);
+            }
+        }
+    }
 
-        if (!(pathThroughput.x > 0) && !(pathThroughput.y > 0) && !(pathThroughput.z > 0))
+    bool converged = true;
+
+    for (std::size_t i = 0; i < active.size(); ++i)
+    {
+        PixelState &pixel = pixels[active[i]];
+
+        if (pixel.samples >= maxSamples_)
+            pixel.converged = true;
+        else if (noiseThreshold_ > 0 && pixel.samples >= minSamples_)
+        {
+            // relative standard error of the mean, with a small floor
+            // so that black pixels can converge too
+            float variance = pixel.m2 / (pixel.samples - 1);
+            float error = sqrtf(variance / pixel.samples);
+            pixel.converged = error <= noiseThreshold_ * std::max(pixel.mean, 1e-2f);
+        }
+
+        converged &= pixel.converged;
+    }
+
+    return converged;
+}
+
+void PathTracer::renderWorker(RenderState *state, ThreadState *thread)
+{
+    thread->ctx = shadingSystem_->get_context(thread->threadInfo);
+
+    int ntiles = (int)state->activeTiles.size();
+
+    for (;;)
+    {
+        int index = state->nextTile++;
+        if (index >= ntiles)
             break;
 
-        specular = (invpdf == 0);
+        Tile &tile = state->tiles[state->activeTiles[index]];
 
-        ray = core::Ray(OSL::Dual2<core::Vec3>(sg.P, sg.dPdx, sg.dPdy), wi);
+        // the first tile of the render warms up the buffers and the per
+        // thread data of the texture system, after that the samples must
+        // not allocate
+        core::CountAllocations(thread->tiles++ > 0);
+        tile.converged = renderTile(*thread, tile, &state->pixels[tile.offset], state->firstSample, state->lastSample);
+        core::CountAllocations(false);
 
-        // possibly terminate the path
-        if (bounces > 3)
+        int newPerc = (100 * (++state->tilesDone)) / ntiles;
+
+        std::lock_guard<std::mutex> lock(state->progressMutex);
+        if (state->progress < newPerc)
         {
-            float continueProbability = std::min(0.5f, pathThroughput.length());
-            if (rng > continueProbability)
-                break;
-            pathThroughput /= continueProbability;
+            printf("%d\n", newPerc);
+            state->progress = newPerc;
         }
     }
 
-    return L;
+    shadingSystem_->release_context(thread->ctx);
 }
 
 void PathTracer::render()
 {
-    OSL::PerThreadInfo *threadInfo = shadingSystem_->create_thread_info();
-    OSL::ShadingContext *ctx = shadingSystem_->get_context(threadInfo);
-
     int xres = camera_->xres();
     int yres = camera_->yres();
-    std::vector<float> pixels(xres * yres * 3);
 
-    int perc = -1;
-
-    for (int y = 0; y < yres; ++y)
+    // the pixel states are stored tile by tile, so that every thread works
+    // on its own block of memory and the workers don't write to the same
+    // cache lines while rendering
+    RenderState state;
+    int offset = 0;
+    for (int y = 0; y < yres; y += tileSize_)
     {
-        for (int x = 0; x < xres; ++x)
+        for (int x = 0; x < xres; x += tileSize_)
         {
-            core::Color3 c(0.f, 0.f, 0.f);
-            for (int i = 0; i < 64; ++i)
-                c += Li(ctx, x, y) / 64.f;
+            Tile tile = { x, y, std::min(x + tileSize_, xres), std::min(y + tileSize_, yres), offset, false };
+            state.tiles.push_back(tile);
+            offset += (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+        }
+    }
 
-            int index = x + y * xres;
+    PixelState zero = { core::Color3(0.f, 0.f, 0.f), 0.f, 0.f, 0, false };
+    state.pixels.resize(offset, zero);
 
-            pixels[index * 3] = pow(c.x, 1.f / 2.2f);
-            pixels[index * 3 + 1] = pow(c.y, 1.f / 2.2f);
-            pixels[index * 3 + 2] = pow(c.z, 1.f / 2.2f);
-        }
+    // the first pass takes the minimum number of samples everywhere, every
+    // following pass doubles the sample count of the unconverged pixels so
+    // that the sample sets stay stratified
+    state.firstSample = 0;
+    state.lastSample = minSamples_;
+
+    std::vector<ThreadState*> threads(threads_);
+    for (int i = 0; i < threads_; ++i)
+    {
+        threads[i] = new ThreadState;
+        threads[i]->threadInfo = shadingSystem_->create_thread_info();
+        threads[i]->ctx = NULL;
+        threads[i]->sampler = sampler_->clone();
+        threads[i]->tiles = 0;
+
+        // sized for the largest tile
+        threads[i]->active.reserve(tileSize_ * tileSize_);
+        threads[i]->samples.resize(std::min(batchSize_, tileSize_ * tileSize_));
+        threads[i]->L.resize(threads[i]->samples.size());
+    }
+
+    long long allocations = core::AllocationCount();
 
-        int newPerc = (100 * (y + 1)) / yres;
-        if (perc != newPerc)
+    for (int pass = 0; ; ++pass)
+    {
+        state.activeTiles.clear();
+        for (std::size_t i = 0; i < state.tiles.size(); ++i)
         {
-            printf("%d\n", newPerc);
-            perc = newPerc;
+            if (!state.tiles[i].converged)
+                state.activeTiles.push_back(i);
         }
+
+        if (state.activeTiles.empty())
+            break;
+
+        if (noiseThreshold_ > 0)
+            core::Info("Pass %d: samples %d-%d, %d of %d tiles active", pass, state.firstSample, state.lastSample, (int)state.activeTiles.size(), (int)state.tiles.size());
+
+        state.nextTile = 0;
+        state.tilesDone = 0;
+        state.progress = -1;
+
+        int nthreads = std::min(threads_, (int)state.activeTiles.size());
+
+        std::vector<std::thread> workers;
+        for (int i = 1; i < nthreads; ++i)
+            workers.push_back(std::thread(&PathTracer::renderWorker, this, &state, threads[i]));
+
+        // the calling thread works on tiles too
+        renderWorker(&state, threads[0]);
+
+        for (std::size_t i = 0; i < workers.size(); ++i)
+            workers[i].join();
+
+        if (state.lastSample >= maxSamples_)
+            break;
+
+        state.firstSample = state.lastSample;
+        state.lastSample = std::min(2 * state.lastSample, maxSamples_);
     }
 
-    shadingSystem_->release_context(ctx);
-    shadingSystem_->destroy_thread_info(threadInfo);
+    allocations = core::AllocationCount() - allocations;
+    if (allocations > 0)
+        core::Severe("%lld heap allocations while tracing samples", allocations);
+
+    for (int i = 0; i < threads_; ++i)
+    {
+        delete threads[i]->sampler;
+        shadingSystem_->destroy_thread_info(threads[i]->threadInfo);
+        delete threads[i];
+    }
+
+    std::vector<float> pixels(xres * yres * 3);
+    std::vector<float> samples(xres * yres);
+
+    for (std::size_t i = 0; i < state.tiles.size(); ++i)
+    {
+        const Tile &tile = state.tiles[i];
+        const PixelState *pixel = &state.pixels[tile.offset];
+
+        for (int y = tile.y0; y < tile.y1; ++y)
+        {
+            for (int x = tile.x0; x < tile.x1; ++x, ++pixel)
+            {
+                core::Color3 c = pixel->sum / (float)pixel->samples;
+
+                int index = x + y * xres;
+
+                pixels[index * 3] = pow(c.x, 1.f / 2.2f);
+                pixels[index * 3 + 1] = pow(c.y, 1.f / 2.2f);
+                pixels[index * 3 + 2] = pow(c.z, 1.f / 2.2f);
+
+                samples[index] = (float)pixel->samples;
+            }
+        }
+    }
 
     const char *imagefile = "out.png";
     OIIO::ImageOutput *out = OIIO::ImageOutput::create(imagefile);
@@ -355,8 +955,18 @@ void PathTracer::render()
     if (out && out->open(imagefile, spec))
         out->write_image(OIIO::TypeDesc::TypeFloat, &pixels[0]);
     delete out;
-}
 
+    // number of samples taken per pixel, to see where the time went
+    if (noiseThreshold_ > 0)
+    {
+        const char *samplesfile = "samples.exr";
+        OIIO::ImageOutput *out = OIIO::ImageOutput::create(samplesfile);
+        OIIO::ImageSpec spec(xres, yres, 1, OIIO::TypeDesc::FLOAT);
+        if (out && out->open(samplesfile, spec))
+            out->write_image(OIIO::TypeDesc::TypeFloat, &samples[0]);
+        delete out;
+    }
+}
 
 }
 }
@@ -3,6 +3,7 @@
 
 #include <core/renderer.hpp>
 #include <core/geometry.hpp>
+#include <core/lightbvh.hpp>
 #include <vector>
 #include <OSL/shading.h>
 #include <OSL/background.h>
@@ -11,6 +12,14 @@ namespace paprika {
 
 namespace core {
 class Primitive;
+class ParameterMap;
+class Sampler;
+class MemoryArena;
+struct InterpolationInfo;
+}
+
+namespace light {
+class EnvironmentLight;
 }
 
 namespace renderer {
@@ -18,20 +27,136 @@ namespace renderer {
 class PathTracer : public core::Renderer
 {
 public:
-    PathTracer(core::Scene *scene, core::Camera *camera, OSL::ShaderGroupRef backgroundShaderGroup, OSL::ShadingSystem *shadingSystem);
-    ~PathTracer();
+    PathTracer(core::Scene *scene, core::Camera *camera, core::Sampler *sampler, OSL::ShaderGroupRef backgroundShaderGroup, light::EnvironmentLight *environment, OSL::ShadingSystem *shadingSystem, core::ParameterMap &params);
+    virtual ~PathTracer();
 
     virtual void render();
 
-private:
-    core::Color3 Li(OSL::ShadingContext *ctx, float x, float y);
-    core::Color3 estimateDirect(OSL::ShadingContext *ctx,
-                                const OSL::ShaderGlobals &sg,
-                                OSL::CompositeBSDF &bsdf);
+protected:
+    struct PixelSample
+    {
+        int x, y;
+        int index;
+    };
+
+    // computes the radiance of count pixel samples. the per sample data lives
+    // in the arena of the thread, which is reset for every batch.
+    virtual void traceSamples(OSL::ShadingContext *ctx, core::Sampler &sampler, core::MemoryArena &arena, int count, const PixelSample *samples, core::Color3 *L);
+
+    // generates the camera ray and returns the first sampler dimension after
+    // the camera dimensions, where the path continues. samplers differ in how
+    // many dimensions the camera sample takes.
+    int startSample(core::Sampler &sampler, const PixelSample &sample, core::Ray *ray) const;
+
+    // the bsdf sample that generated a ray, pdf is infinity for camera rays
+    // and specular bounces
+    struct BsdfSample
+    {
+        float pdf;
+        core::Vec3 N;       // shading normal at the origin of the ray
+    };
+
+    // background seen by a ray
+    core::Color3 evalBackground(OSL::ShadingContext *ctx, const core::Ray &ray, const BsdfSample &bsdfSample);
+
+    // emission Le of the primitive hit by the ray, weighted against light
+    // sampling at the origin of the ray
+    core::Color3 evalEmission(const core::Ray &ray,
+                              const BsdfSample &bsdfSample,
+                              const core::Primitive *primitive,
+                              const core::InterpolationInfo &interp,
+                              const OSL::ShaderGlobals &sg,
+                              const core::Color3 &Le) const;
+
+    // probability of picking the light, or the background if light is NULL,
+    // for the point p with normal n
+    float lightPdf(const core::Vec3 &p, const core::Vec3 &n, const core::Primitive *light) const;
+
+    // light sampled part of the direct lighting estimate, L only counts if
+    // the shadow ray is unoccluded
+    struct ShadowRay
+    {
+        core::Ray ray;
+        core::Color3 L;
+    };
+
+    // samples a light, the visibility of the sample is left to the caller
+    // so that shadow rays can be tested in batches. the bsdf sampled part of
+    // the estimate is found by the continuation ray of the path.
+    void estimateDirect(OSL::ShadingContext *ctx,
+                        core::Sampler &sampler,
+                        const OSL::ShaderGlobals &sg,
+                        OSL::CompositeBSDF &bsdf,
+                        ShadowRay &shadowRay);
+
+    // samples the bsdf for the next path segment, returns false if the path
+    // is terminated
+    bool continuePath(core::Sampler &sampler,
+                      const OSL::ShaderGlobals &sg,
+                      const OSL::CompositeBSDF &bsdf,
+                      int bounces,
+                      core::Color3 &pathThroughput,
+                      BsdfSample &bsdfSample,
+                      core::Ray &ray);
 
     std::vector<core::Primitive*> lights_;
+    core::LightBVH lightBVH_;
+
+    // environment map that replaces the background shader, if any
+    light::EnvironmentLight *environment_;
 
     OSL::Background *background_;
+
+    // number of pixel samples traced together
+    int batchSize_;
+
+private:
+    // resolution of the background importance table that resolves the
+    // environment textures of the background shader
+    int backgroundResolution() const;
+
+    // true if the shader group of the light reads nothing that varies over
+    // its surface, so that its emission can be evaluated once
+    bool isConstantEmitter(const core::Primitive *light) const;
+
+    // emitted radiance of the light at the point
+    core::Color3 evalEmitter(OSL::ShadingContext *ctx, core::Primitive *light, int primID, const core::Vec3 &p, const core::Vec3 &n);
+
+    // emitted power of a light, from its emission at a few points
+    float estimatePower(OSL::ShadingContext *ctx, core::Primitive *light);
+
+    // weights the primitives of the light by their emission for sampling
+    void weightByEmission(OSL::ShadingContext *ctx, core::Primitive *light);
+
+    struct Tile
+    {
+        int x0, y0;
+        int x1, y1;
+        int offset;
+        bool converged;
+    };
+
+    struct PixelState;
+    struct RenderState;
+    struct ThreadState;
+
+    void renderWorker(RenderState *state, ThreadState *thread);
+    bool renderTile(ThreadState &thread, const Tile &tile, PixelState *pixels, int firstSample, int lastSample);
+
+    core::Color3 Li(OSL::ShadingContext *ctx,
+                    core::Sampler &sampler,
+                    const core::Ray &cameraRay,
+                    core::Primitive *primitive,
+                    core::InterpolationInfo &interp,
+                    OSL::ShaderGlobals &sg);
+
+    core::Sampler *sampler_;
+
+    int threads_;
+    int tileSize_;
+
+    int minSamples_, maxSamples_;
+    float noiseThreshold_;
 };
 
 }
@@ -0,0 +1,160 @@
+#include <renderers/wavefrontpathtracer.hpp>
+#include <core/camera.hpp>
+#include <core/primitive.hpp>
+#include <core/scene.hpp>
+#include <core/sampler.hpp>
+#include <core/parametermap.hpp>
+#include <core/memoryarena.hpp>
+#include <algorithm>
+#include <new>
+#include <limits>
+
+namespace paprika {
+namespace renderer {
+
+WavefrontPathTracer::WavefrontPathTracer(core::Scene *scene, core::Camera *camera, core::Sampler *sampler, OSL::ShaderGroupRef backgroundShaderGroup, light::EnvironmentLight *environment, OSL::ShadingSystem *shadingSystem, core::ParameterMap &params) :
+    PathTracer(scene, camera, sampler, backgroundShaderGroup, environment, shadingSystem, params)
+{
+    // a wave is at most one sample of all pixels of a tile
+    batchSize_ = std::max(1, params.find("wavefrontsize", OIIO::TypeDesc::INT, 1024));
+}
+
+void WavefrontPathTracer::traceSamples(OSL::ShadingContext *ctx, core::Sampler &sampler, core::MemoryArena &arena, int count, const PixelSample *samples, core::Color3 *L)
+{
+    Path *paths = arena.alloc<Path>(count);
+
+    // per stage data is indexed by the position of the path in the queue.
+    // every stage handles at most count paths, so all of it is allocated up
+    // front
+    int *queue = arena.alloc<int>(count);
+    int *nextQueue = arena.alloc<int>(count);
+    core::Ray *rays = arena.alloc<core::Ray>(count);
+    core::Primitive **primitives = arena.alloc<core::Primitive*>(count);
+    core::InterpolationInfo *interps = arena.alloc<core::InterpolationInfo>(count);
+    OSL::ShaderGlobals *sgs = arena.alloc<OSL::ShaderGlobals>(count);
+    OSL::ShadingResult *results = static_cast<OSL::ShadingResult*>(arena.alloc(count * sizeof(OSL::ShadingResult), alignof(OSL::ShadingResult)));
+    std::pair<OSL::ShaderGroup*, int> *hits = arena.alloc<std::pair<OSL::ShaderGroup*, int> >(count);
+    ShadowRay *lightSamples = arena.alloc<ShadowRay>(count);
+    int *shadowIndex = arena.alloc<int>(count);
+    core::Ray *shadowRays = arena.alloc<core::Ray>(count);
+    uint32_t *visible = arena.alloc<uint32_t>((count + 31) / 32);
+
+    // generate camera rays
+    for (int i = 0; i < count; ++i)
+    {
+        Path &path = paths[i];
+
+        path.dimension = startSample(sampler, samples[i], &path.ray);
+
+        path.throughput = core::Color3(1.f, 1.f, 1.f);
+        path.bounces = 0;
+        path.bsdfSample.pdf = std::numeric_limits<float>::infinity();
+
+        L[i] = core::Color3(0.f, 0.f, 0.f);
+        queue[i] = i;
+    }
+
+    for (int n = count; n > 0; )
+    {
+        // intersect
+        for (int k = 0; k < n; ++k)
+        {
+            rays[k] = paths[queue[k]].ray;
+            memset(&sgs[k], 0, sizeof(OSL::ShaderGlobals));
+        }
+
+        scene_->intersect(n, rays, primitives, interps, sgs);
+
+        // finish the paths that escaped and sort the hits by shader group,
+        // so that paths with the same material are shaded together
+        int nhits = 0;
+        for (int k = 0; k < n; ++k)
+        {
+            Path &path = paths[queue[k]];
+
+            if (primitives[k] == NULL)
+            {
+                L[queue[k]] += path.throughput * evalBackground(ctx, rays[k], path.bsdfSample);
+                continue;
+            }
+
+            hits[nhits++] = std::make_pair(primitives[k]->shaderGroup().get(), k);
+        }
+
+        std::sort(hits, hits + nhits);
+
+        // shade
+        for (int h = 0; h < nhits; ++h)
+        {
+            int k = hits[h].second;
+            Path &path = paths[queue[k]];
+
+            shadingSystem_->execute(ctx, *hits[h].first, sgs[k]);
+
+            // the composite bsdf can't be copied, results are constructed in place
+            OSL::ShadingResult *result = new (&results[k]) OSL::ShadingResult;
+            OSL::process_closure(*result, sgs[k].Ci, false);
+
+            result->bsdf.prepare(sgs[k], core::Color3(1, 1, 1), false);
+
+            L[queue[k]] += path.throughput * evalEmission(rays[k], path.bsdfSample, primitives[k], interps[k], sgs[k], result->Le);
+        }
+
+        // next event estimation, the shadow rays of all paths are tested
+        // together
+        int nshadow = 0;
+        for (int h = 0; h < nhits; ++h)
+        {
+            int k = hits[h].second;
+            Path &path = paths[queue[k]];
+            const PixelSample &sample = samples[queue[k]];
+
+            sampler.startPixelSample(sample.x, sample.y, sample.index, path.dimension);
+            estimateDirect(ctx, sampler, sgs[k], results[k].bsdf, lightSamples[k]);
+            path.dimension = sampler.dimension();
+
+            if (lightSamples[k].L != core::Color3(0, 0, 0))
+            {
+                shadowIndex[k] = nshadow;
+                shadowRays[nshadow++] = lightSamples[k].ray;
+            }
+            else
+                shadowIndex[k] = -1;
+        }
+
+        if (nshadow > 0)
+            scene_->isVisible(nshadow, shadowRays, visible);
+
+        for (int h = 0; h < nhits; ++h)
+        {
+            int k = hits[h].second;
+            int s = shadowIndex[k];
+
+            if (s >= 0 && (visible[s / 32] & (1u << (s % 32))))
+                L[queue[k]] += paths[queue[k]].throughput * lightSamples[k].L;
+        }
+
+        // continue
+        int nnext = 0;
+        for (int h = 0; h < nhits; ++h)
+        {
+            int k = hits[h].second;
+            Path &path = paths[queue[k]];
+            const PixelSample &sample = samples[queue[k]];
+
+            sampler.startPixelSample(sample.x, sample.y, sample.index, path.dimension);
+            bool alive = continuePath(sampler, sgs[k], results[k].bsdf, path.bounces, path.throughput, path.bsdfSample, path.ray);
+            path.dimension = sampler.dimension();
+            path.bounces++;
+
+            if (alive)
+                nextQueue[nnext++] = queue[k];
+        }
+
+        std::swap(queue, nextQueue);
+        n = nnext;
+    }
+}
+
+}
+}
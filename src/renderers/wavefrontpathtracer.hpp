@@ -0,0 +1,34 @@
+#ifndef WAVEFRONTPATHTRACER_HPP
+#define WAVEFRONTPATHTRACER_HPP
+
+#include <renderers/pathtracer.hpp>
+
+namespace paprika {
+namespace renderer {
+
+// Advances a large batch of paths one stage at a time: intersect, sort the
+// hits by shader group, shade, estimate direct lighting and continue. The
+// paths use the same sampler dimensions as the PathTracer, so both render
+// the same image.
+class WavefrontPathTracer : public PathTracer
+{
+public:
+    WavefrontPathTracer(core::Scene *scene, core::Camera *camera, core::Sampler *sampler, OSL::ShaderGroupRef backgroundShaderGroup, light::EnvironmentLight *environment, OSL::ShadingSystem *shadingSystem, core::ParameterMap &params);
+
+protected:
+    virtual void traceSamples(OSL::ShadingContext *ctx, core::Sampler &sampler, core::MemoryArena &arena, int count, const PixelSample *samples, core::Color3 *L);
+
+private:
+    struct Path
+    {
+        core::Ray ray;
+        core::Color3 throughput;
+        int bounces;
+        int dimension;      // next sampler dimension
+        BsdfSample bsdfSample;
+    };
+};
+
+}
+}
+#endif
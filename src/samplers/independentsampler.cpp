@@ -0,0 +1,37 @@
+#include <samplers/independentsampler.hpp>
+
+namespace paprika {
+namespace sampler {
+
+IndependentSampler::IndependentSampler(uint32_t seed) :
+    Sampler(seed)
+{
+
+}
+
+IndependentSampler *IndependentSampler::create(core::ParameterMap &map)
+{
+    int seed = map.find("seed", OIIO::TypeDesc::INT, 0);
+
+    return new IndependentSampler(seed);
+}
+
+float IndependentSampler::get1D()
+{
+    uint32_t pixel = hash(x_, y_, seed_);
+    return toFloat(hash(pixel, sampleIndex_, dimension_++, seed_));
+}
+
+void IndependentSampler::get2D(float *u1, float *u2)
+{
+    *u1 = get1D();
+    *u2 = get1D();
+}
+
+core::Sampler *IndependentSampler::clone() const
+{
+    return new IndependentSampler(*this);
+}
+
+}		// sampler
+}		// paprika
@@ -0,0 +1,28 @@
+#ifndef SAMPLER_INDEPENDENTSAMPLER_HPP
+#define SAMPLER_INDEPENDENTSAMPLER_HPP
+
+#include <core/sampler.hpp>
+#include <core/parametermap.hpp>
+
+namespace paprika {
+namespace sampler {
+
+// Uniform random numbers without any stratification. Every dimension is a
+// hash of (pixel, sample index, dimension, seed).
+class IndependentSampler : public core::Sampler
+{
+public:
+    IndependentSampler(uint32_t seed);
+
+    static IndependentSampler *create(core::ParameterMap &map);
+
+    virtual float get1D();
+    virtual void get2D(float *u1, float *u2);
+
+    virtual core::Sampler *clone() const;
+};
+
+}		// sampler
+}		// paprika
+
+#endif
@@ -0,0 +1,241 @@
+#include <samplers/pmj02sampler.hpp>
+#include <OSL/sampling.h>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+namespace paprika {
+namespace sampler {
+
+// number of generated sequences and their length, which must be a power of
+// four. sample indices beyond the length wrap around with a different shuffle.
+static const int PMJ02_SETS = 16;
+static const int PMJ02_SIZE = 1024;
+
+// generates one pmj02 sequence by alternately placing new points in the
+// diagonally opposite and in the remaining subquadrants of the old points,
+// rejecting candidates that fall into an elementary interval that is already
+// occupied
+class PMJ02Generator
+{
+public:
+    PMJ02Generator(int seed) : rng_(seed)
+    {
+
+    }
+
+    void generate(int n, float *points)
+    {
+        xs_.clear();
+        ys_.clear();
+
+        xs_.push_back(rng_);
+        ys_.push_back(rng_);
+
+        for (int count = 1; count < n; count *= 4)
+        {
+            extendEven(count);
+            if (2 * count < n)
+                extendOdd(2 * count);
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            points[i * 2] = xs_[i];
+            points[i * 2 + 1] = ys_[i];
+        }
+    }
+
+private:
+    // doubles the sequence from count = 4^k points
+    void extendEven(int count)
+    {
+        int n = (int)(sqrtf((float)count) + 0.5f);
+
+        markOccupied(2 * count);
+
+        for (int s = 0; s < count; ++s)
+        {
+            int i, j, xhalf, yhalf;
+            cell(s, n, &i, &j, &xhalf, &yhalf);
+            addPoint(i, j, 1 - xhalf, 1 - yhalf, n);
+        }
+    }
+
+    // doubles the sequence from count = 2 * 4^k points
+    void extendOdd(int count)
+    {
+        int n = (int)(sqrtf((float)(count / 2)) + 0.5f);
+
+        markOccupied(2 * count);
+
+        // flipping the same axis for every point keeps the new half of the
+        // sequence stratified, a random flip per point can reach dead ends
+        bool flipx = rng_ < 0.5f;
+
+        for (int s = 0; s < count / 2; ++s)
+        {
+            int i, j, xhalf, yhalf;
+            cell(s, n, &i, &j, &xhalf, &yhalf);
+
+            if (flipx)
+                xhalf = 1 - xhalf;
+            else
+                yhalf = 1 - yhalf;
+
+            addPoint(i, j, xhalf, yhalf, n);
+        }
+
+        for (int s = 0; s < count / 2; ++s)
+        {
+            int i, j, xhalf, yhalf;
+            cell(s, n, &i, &j, &xhalf, &yhalf);
+
+            if (flipx)
+                yhalf = 1 - yhalf;
+            else
+                xhalf = 1 - xhalf;
+
+            addPoint(i, j, xhalf, yhalf, n);
+        }
+    }
+
+    void cell(int s, int n, int *i, int *j, int *xhalf, int *yhalf) const
+    {
+        float x = xs_[s] * n;
+        float y = ys_[s] * n;
+        *i = (int)x;
+        *j = (int)y;
+        *xhalf = (int)(2 * (x - *i));
+        *yhalf = (int)(2 * (y - *j));
+    }
+
+    void markOccupied(int count)
+    {
+        log2n_ = 0;
+        while ((1 << log2n_) < count)
+            ++log2n_;
+
+        occupied_.assign((log2n_ + 1) * count, false);
+
+        for (std::size_t i = 0; i < xs_.size(); ++i)
+            setOccupied(xs_[i], ys_[i]);
+    }
+
+    bool isOccupied(float x, float y) const
+    {
+        int count = 1 << log2n_;
+        for (int a = 0; a <= log2n_; ++a)
+        {
+            int nx = 1 << a;
+            int ny = 1 << (log2n_ - a);
+            if (occupied_[a * count + (int)(x * nx) + (int)(y * ny) * nx])
+                return true;
+        }
+        return false;
+    }
+
+    void setOccupied(float x, float y)
+    {
+        int count = 1 << log2n_;
+        for (int a = 0; a <= log2n_; ++a)
+        {
+            int nx = 1 << a;
+            int ny = 1 << (log2n_ - a);
+            occupied_[a * count + (int)(x * nx) + (int)(y * ny) * nx] = true;
+        }
+    }
+
+    void addPoint(int i, int j, int xhalf, int yhalf, int n)
+    {
+        float x, y;
+        do
+        {
+            x = std::min((i + 0.5f * (xhalf + rng_)) / n, 0.99999994f);
+            y = std::min((j + 0.5f * (yhalf + rng_)) / n, 0.99999994f);
+        } while (isOccupied(x, y));
+
+        setOccupied(x, y);
+        xs_.push_back(x);
+        ys_.push_back(y);
+    }
+
+    OSL::Rng rng_;
+    std::vector<float> xs_, ys_;
+    std::vector<bool> occupied_;
+    int log2n_;
+};
+
+// the sequences as 32 bit fixed point numbers, interleaved x and y
+static std::vector<uint32_t> generatePMJ02Table()
+{
+    std::vector<uint32_t> table(PMJ02_SETS * PMJ02_SIZE * 2);
+    std::vector<float> points(PMJ02_SIZE * 2);
+
+    for (int set = 0; set < PMJ02_SETS; ++set)
+    {
+        PMJ02Generator generator(set + 1);
+        generator.generate(PMJ02_SIZE, &points[0]);
+
+        for (int i = 0; i < PMJ02_SIZE * 2; ++i)
+            table[set * PMJ02_SIZE * 2 + i] = (uint32_t)(points[i] * 4294967296.0);
+    }
+
+    return table;
+}
+
+static const std::vector<uint32_t> &pmj02Table()
+{
+    static const std::vector<uint32_t> table = generatePMJ02Table();
+    return table;
+}
+
+PMJ02Sampler::PMJ02Sampler(uint32_t seed) :
+    Sampler(seed)
+{
+
+}
+
+PMJ02Sampler *PMJ02Sampler::create(core::ParameterMap &map)
+{
+    int seed = map.find("seed", OIIO::TypeDesc::INT, 0);
+
+    // generate the sequences now, before the render threads start
+    pmj02Table();
+
+    return new PMJ02Sampler(seed);
+}
+
+const uint32_t *PMJ02Sampler::sample(uint32_t dimensionSeed) const
+{
+    int set = hash(dimensionSeed, 0, 2) % PMJ02_SETS;
+    uint32_t index = owenScramble(sampleIndex_, dimensionSeed) & (PMJ02_SIZE - 1);
+
+    return &pmj02Table()[(set * PMJ02_SIZE + index) * 2];
+}
+
+float PMJ02Sampler::get1D()
+{
+    uint32_t dimensionSeed = hash(hash(x_, y_, seed_), dimension_++, 0x5851f42du);
+    const uint32_t *p = sample(dimensionSeed);
+
+    // random digit scrambling keeps the points stratified
+    return toFloat(p[0] ^ hash(dimensionSeed, 1, 2));
+}
+
+void PMJ02Sampler::get2D(float *u1, float *u2)
+{
+    uint32_t dimensionSeed = hash(hash(x_, y_, seed_), dimension_++, 0x5851f42du);
+    const uint32_t *p = sample(dimensionSeed);
+
+    *u1 = toFloat(p[0] ^ hash(dimensionSeed, 1, 2));
+    *u2 = toFloat(p[1] ^ hash(dimensionSeed, 2, 2));
+}
+
+core::Sampler *PMJ02Sampler::clone() const
+{
+    return new PMJ02Sampler(*this);
+}
+
+}		// sampler
+}		// paprika
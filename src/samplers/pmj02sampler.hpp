@@ -0,0 +1,33 @@
+#ifndef SAMPLER_PMJ02SAMPLER_HPP
+#define SAMPLER_PMJ02SAMPLER_HPP
+
+#include <core/sampler.hpp>
+#include <core/parametermap.hpp>
+
+namespace paprika {
+namespace sampler {
+
+// Progressive multi-jittered (0,2) sequences, see Christensen et al.,
+// "Progressive Multi-Jittered Sample Sequences", EGSR 2018.
+// A small set of sequences is generated once and every 1D or 2D request
+// picks one of them, shuffles the sample index and xor scrambles the result.
+class PMJ02Sampler : public core::Sampler
+{
+public:
+    PMJ02Sampler(uint32_t seed);
+
+    static PMJ02Sampler *create(core::ParameterMap &map);
+
+    virtual float get1D();
+    virtual void get2D(float *u1, float *u2);
+
+    virtual core::Sampler *clone() const;
+
+private:
+    const uint32_t *sample(uint32_t dimensionSeed) const;
+};
+
+}		// sampler
+}		// paprika
+
+#endif
@@ -0,0 +1,55 @@
+#include <samplers/sobolsampler.hpp>
+
+namespace paprika {
+namespace sampler {
+
+// second dimension of the Sobol sequence, the first one is the van der Corput
+// sequence (reversed index bits)
+static uint32_t sobol1(uint32_t index)
+{
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+SobolSampler::SobolSampler(uint32_t seed) :
+    Sampler(seed)
+{
+
+}
+
+SobolSampler *SobolSampler::create(core::ParameterMap &map)
+{
+    int seed = map.find("seed", OIIO::TypeDesc::INT, 0);
+
+    return new SobolSampler(seed);
+}
+
+float SobolSampler::get1D()
+{
+    uint32_t dimensionSeed = hash(hash(x_, y_, seed_), dimension_++, 0x5851f42du);
+    uint32_t index = owenScramble(sampleIndex_, dimensionSeed);
+
+    return toFloat(owenScramble(reverseBits(index), hash(dimensionSeed, 0, 1)));
+}
+
+void SobolSampler::get2D(float *u1, float *u2)
+{
+    uint32_t dimensionSeed = hash(hash(x_, y_, seed_), dimension_++, 0x5851f42du);
+    uint32_t index = owenScramble(sampleIndex_, dimensionSeed);
+
+    *u1 = toFloat(owenScramble(reverseBits(index), hash(dimensionSeed, 1, 1)));
+    *u2 = toFloat(owenScramble(sobol1(index), hash(dimensionSeed, 2, 1)));
+}
+
+core::Sampler *SobolSampler::clone() const
+{
+    return new SobolSampler(*this);
+}
+
+}		// sampler
+}		// paprika
@@ -0,0 +1,30 @@
+#ifndef SAMPLER_SOBOLSAMPLER_HPP
+#define SAMPLER_SOBOLSAMPLER_HPP
+
+#include <core/sampler.hpp>
+#include <core/parametermap.hpp>
+
+namespace paprika {
+namespace sampler {
+
+// Owen scrambled Sobol (0,2) sequence. Every 1D or 2D request is padded from
+// the first two Sobol dimensions with its own shuffle and scramble seeds, so
+// each pair of dimensions is well stratified for any power of two sample
+// count, and the sequence stays progressive.
+class SobolSampler : public core::Sampler
+{
+public:
+    SobolSampler(uint32_t seed);
+
+    static SobolSampler *create(core::ParameterMap &map);
+
+    virtual float get1D();
+    virtual void get2D(float *u1, float *u2);
+
+    virtual core::Sampler *clone() const;
+};
+
+}		// sampler
+}		// paprika
+
+#endif
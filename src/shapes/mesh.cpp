@@ -72,22 +72,20 @@ Mesh::Mesh(RTCDevice device, const char* interp, int nfaces, const int* nverts,
     }
 
     // calculate mesh area and pdf
-    pdf_.resize(triangles_.size() + 1);
+    areas_.resize(triangles_.size());
     area_ = 0.f;
     for (std::size_t i = 0; i < triangles_.size(); ++i)
     {
         const core::Vec3& p0 = P_[triangles_[i].v[0]];
         const core::Vec3& p1 = P_[triangles_[i].v[1]];
         const core::Vec3& p2 = P_[triangles_[i].v[2]];
-        pdf_[i] = area_;
-        area_ += 0.5f * ((p1 - p0).cross(p2 - p0)).length();
+        areas_[i] = 0.5f * ((p1 - p0).cross(p2 - p0)).length();
+        area_ += areas_[i];
     }
-    pdf_[triangles_.size()] = area_;
 
-    for (std::size_t i = 0; i < pdf_.size(); ++i)
-        pdf_[i] /= area_;
+    setPrimWeights(std::vector<float>());
 
-    scene_ = rtcDeviceNewScene(device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+    scene_ = rtcDeviceNewScene(device, RTC_SCENE_STATIC, rtcAlgorithmFlags(device));
 
     geomID_ = rtcNewTriangleMesh(scene_, RTC_GEOMETRY_STATIC, triangles_.size(), nVertex, 1);
 
@@ -117,30 +115,75 @@ Mesh::~Mesh()
     rtcDeleteScene(scene_);
 }
 
-void Mesh::fillHitInfo(const core::Ray &ray, int primID, core::HitInfo *hitInfo) const
+void Mesh::fillHitInfo(const core::Ray &ray, const core::RayHit &hit, bool derivatives, core::HitInfo *hitInfo) const
 {
-    hitInfo->primID = primID;
+    hitInfo->primID = hit.primID;
 
-    const Triangle &t = triangles_[primID];
+    const Triangle &t = triangles_[hit.primID];
 
     const core::Vec3 &v0 = P_[t.v[0]];
     const core::Vec3 &v1 = P_[t.v[1]];
     const core::Vec3 &v2 = P_[t.v[2]];
     core::Vec3 e1 = v1 - v0;
     core::Vec3 e2 = v2 - v0;
-    OSL::Dual2<core::Vec3> pvec = cross(ray.d, e2);
-    OSL::Dual2<float> det = dot(e1, pvec);
-    OSL::Dual2<float> invDet = 1.f / det;
-    OSL::Dual2<core::Vec3> tvec = ray.o - v0;
-    hitInfo->u = dot(tvec, pvec) * invDet;
-    OSL::Dual2<core::Vec3> qvec = cross(tvec, e1);
-    hitInfo->v = dot(ray.d, qvec) * invDet;
-    hitInfo->t = dot(e2, qvec) * invDet;
 
-    hitInfo->Ng = e1.cross(e2).normalized();
+    // the winding of the triangle rather than embree's Ng decides which
+    // side is the front
+    core::Vec3 Ng = e1.cross(e2);
+    hitInfo->Ng = Ng.normalized();
 
     hitInfo->dPdu = e1;
     hitInfo->dPdv = e2;
+
+    // differentials of t from the offset rays hitting the plane of the
+    // triangle
+    float dn = ray.d.val().dot(Ng);
+    core::Vec3 dPdx = ray.o.dx() + ray.d.dx() * hit.t;
+    core::Vec3 dPdy = ray.o.dy() + ray.d.dy() * hit.t;
+    float dtdx = dn != 0 ? -dPdx.dot(Ng) / dn : 0.f;
+    float dtdy = dn != 0 ? -dPdy.dot(Ng) / dn : 0.f;
+
+    hitInfo->t = OSL::Dual2<float>(hit.t, dtdx, dtdy);
+    hitInfo->u = OSL::Dual2<float>(hit.u, 0.f, 0.f);
+    hitInfo->v = OSL::Dual2<float>(hit.v, 0.f, 0.f);
+
+    if (derivatives)
+    {
+        // express the offsets of P in the edges, dP = du * e1 + dv * e2
+        dPdx += ray.d.val() * dtdx;
+        dPdy += ray.d.val() * dtdy;
+
+        float a = e1.dot(e1), b = e1.dot(e2), c = e2.dot(e2);
+        float det = a * c - b * b;
+        if (det != 0)
+        {
+            float invDet = 1.f / det;
+            float x1 = e1.dot(dPdx), x2 = e2.dot(dPdx);
+            float y1 = e1.dot(dPdy), y2 = e2.dot(dPdy);
+            hitInfo->u = OSL::Dual2<float>(hit.u, (c * x1 - b * x2) * invDet, (c * y1 - b * y2) * invDet);
+            hitInfo->v = OSL::Dual2<float>(hit.v, (a * x2 - b * x1) * invDet, (a * y2 - b * y1) * invDet);
+        }
+    }
+}
+
+void Mesh::intersectPrim(const core::Ray &ray, int primID, core::RayHit *hit) const
+{
+    const Triangle &t = triangles_[primID];
+
+    const core::Vec3 &v0 = P_[t.v[0]];
+    const core::Vec3 &v1 = P_[t.v[1]];
+    const core::Vec3 &v2 = P_[t.v[2]];
+    core::Vec3 e1 = v1 - v0;
+    core::Vec3 e2 = v2 - v0;
+    core::Vec3 pvec = ray.d.val().cross(e2);
+    float invDet = 1.f / e1.dot(pvec);
+    core::Vec3 tvec = ray.o.val() - v0;
+    core::Vec3 qvec = tvec.cross(e1);
+
+    hit->primID = primID;
+    hit->u = tvec.dot(pvec) * invDet;
+    hit->v = ray.d.val().dot(qvec) * invDet;
+    hit->t = e2.dot(qvec) * invDet;
 }
 
 void Mesh::fillInterpolationInfo(const core::HitInfo &hitInfo, core::InterpolationInfo *interp) const
@@ -149,7 +192,7 @@ void Mesh::fillInterpolationInfo(const core::HitInfo &hitInfo, core::Interpolati
 
     interp->ipiece = t.iface;
 
-    interp->weights.resize(3);
+    interp->nweights = 3;
     interp->weights[0] = core::InterpolationInfo::Weight(t.v[0], t.l[0], 1.f - hitInfo.u - hitInfo.v);
     interp->weights[1] = core::InterpolationInfo::Weight(t.v[1], t.l[1], hitInfo.u);
     interp->weights[2] = core::InterpolationInfo::Weight(t.v[2], t.l[2], hitInfo.v);
@@ -162,17 +205,87 @@ float Mesh::area() const
     return area_;
 }
 
+core::BBox Mesh::bounds(const core::Transform &objectToWorld) const
+{
+    core::BBox bounds;
+    for (std::size_t i = 0; i < P_.size(); ++i)
+        bounds.extendBy(objectToWorld.transformPoint(P_[i]));
+    return bounds;
+}
+
+void Mesh::normalCone(const core::Transform &objectToWorld, core::Vec3 *axis, float *cosTheta) const
+{
+    // normals are transformed the same way sample() does
+    std::vector<core::Vec3> normals(triangles_.size());
+    core::Vec3 sum(0.f, 0.f, 0.f);
+    for (std::size_t i = 0; i < triangles_.size(); ++i)
+    {
+        const core::Vec3 &v0 = P_[triangles_[i].v[0]];
+        const core::Vec3 &v1 = P_[triangles_[i].v[1]];
+        const core::Vec3 &v2 = P_[triangles_[i].v[2]];
+        core::Vec3 n = objectToWorld.transformNormal((v1 - v0).cross(v2 - v0));
+        sum += n;
+        normals[i] = n.normalized();
+    }
+
+    if (sum.length2() == 0)
+    {
+        core::Shape::normalCone(objectToWorld, axis, cosTheta);
+        return;
+    }
+
+    *axis = sum.normalized();
+    *cosTheta = 1.f;
+    for (std::size_t i = 0; i < normals.size(); ++i)
+        *cosTheta = std::min(*cosTheta, axis->dot(normals[i]));
+}
+
 void Mesh::sample(float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const
 {
-    int index = std::lower_bound(pdf_.begin() + 1, pdf_.end() - 1, u3) - pdf_.begin() - 1;
+    *primID = triangleTable_.sample(u3);
+    samplePrim(*primID, u1, u2, p, n);
+}
 
+float Mesh::pdf(int primID, const core::Vec3 &p) const
+{
+    if (areas_[primID] == 0)
+        return 0.f;
+
+    return triangleTable_.pdf(primID) / areas_[primID];
+}
+
+int Mesh::primCount() const
+{
+    return (int)triangles_.size();
+}
+
+void Mesh::setPrimWeights(const std::vector<float> &weights)
+{
+    std::vector<float> w(areas_);
+    if (!weights.empty())
+    {
+        float sum = 0.f;
+        for (std::size_t i = 0; i < w.size(); ++i)
+            sum += std::max(0.f, areas_[i] * weights[i]);
+
+        // a mesh that is dark everywhere keeps area weighting
+        if (sum > 0)
+        {
+            for (std::size_t i = 0; i < w.size(); ++i)
+                w[i] *= weights[i];
+        }
+    }
+
+    triangleTable_.build(w.empty() ? NULL : &w[0], (int)w.size());
+}
+
+void Mesh::samplePrim(int primID, float u1, float u2, core::Vec3 *p, core::Vec3 *n) const
+{
     float su1 = sqrt(u1);
     float u = 1 - su1;
     float v = u2 * su1;
 
-    *primID = index;
-
-    const Triangle &t = triangles_[index];
+    const Triangle &t = triangles_[primID];
 
     const core::Vec3 &v0 = P_[t.v[0]];
     const core::Vec3 &v1 = P_[t.v[1]];
@@ -183,5 +296,103 @@ void Mesh::sample(float u1, float u2, float u3, int *primID, core::Vec3 *p, core
     *n = (v1 - v0).cross(v2 - v0).normalized();
 }
 
+// triangles that subtend a tiny solid angle are sampled by area, since
+// the spherical construction loses precision; so are triangles that
+// almost cover the hemisphere
+static const float MIN_SPHERICAL_SOLID_ANGLE = 3e-4f;
+static const float MAX_SPHERICAL_SOLID_ANGLE = 6.22f;
+
+// angle between two unit vectors, accurate for nearly parallel vectors
+static float angleBetween(const core::Vec3 &a, const core::Vec3 &b)
+{
+    if (a.dot(b) < 0)
+        return F_PI - 2 * asinf(std::min(1.f, (a + b).length() * 0.5f));
+    return 2 * asinf(std::min(1.f, (b - a).length() * 0.5f));
+}
+
+// component of v orthogonal to the unit vector w, normalized
+static core::Vec3 orthogonalize(const core::Vec3 &v, const core::Vec3 &w)
+{
+    return (v - w * v.dot(w)).normalized();
+}
+
+float Mesh::sphericalSamplingSolidAngle(const core::Vec3 &ps, const Triangle &t) const
+{
+    core::Vec3 a = (P_[t.v[0]] - ps).normalized();
+    core::Vec3 b = (P_[t.v[1]] - ps).normalized();
+    core::Vec3 c = (P_[t.v[2]] - ps).normalized();
+
+    // "The Solid Angle of a Plane Triangle" by Van Oosterom and Strackee
+    float solidAngle = fabsf(2 * atan2f(a.dot(b.cross(c)), 1 + a.dot(b) + a.dot(c) + b.dot(c)));
+
+    if (!(solidAngle >= MIN_SPHERICAL_SOLID_ANGLE && solidAngle <= MAX_SPHERICAL_SOLID_ANGLE))
+        return 0.f;
+
+    return solidAngle;
+}
+
+void Mesh::sample(const core::Vec3 &ps, float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const
+{
+    *primID = triangleTable_.sample(u3);
+
+    const Triangle &t = triangles_[*primID];
+
+    float solidAngle = sphericalSamplingSolidAngle(ps, t);
+    if (solidAngle == 0)
+    {
+        samplePrim(*primID, u1, u2, p, n);
+        return;
+    }
+
+    const core::Vec3 &v0 = P_[t.v[0]];
+    const core::Vec3 &v1 = P_[t.v[1]];
+    const core::Vec3 &v2 = P_[t.v[2]];
+
+    // "Stratified Sampling of Spherical Triangles" by Arvo
+    core::Vec3 a = (v0 - ps).normalized();
+    core::Vec3 b = (v1 - ps).normalized();
+    core::Vec3 c = (v2 - ps).normalized();
+
+    core::Vec3 nab = a.cross(b).normalized();
+    core::Vec3 nca = c.cross(a).normalized();
+
+    float alpha = angleBetween(nab, -nca);
+    float cosAlpha = cosf(alpha);
+    float sinAlpha = sinf(alpha);
+
+    // area of the sub-triangle to sample, plus pi
+    float areaPi = F_PI + u1 * solidAngle;
+    float sinPhi = sinf(areaPi) * cosAlpha - cosf(areaPi) * sinAlpha;
+    float cosPhi = cosf(areaPi) * cosAlpha + sinf(areaPi) * sinAlpha;
+
+    float k1 = cosPhi + cosAlpha;
+    float k2 = sinPhi - sinAlpha * a.dot(b);
+    float cosBp = (k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) / ((k2 * sinPhi + k1 * cosPhi) * sinAlpha);
+    cosBp = std::min(1.f, std::max(-1.f, cosBp));
+    float sinBp = sqrtf(std::max(0.f, 1 - cosBp * cosBp));
+
+    // third vertex of the sub-triangle, then a direction on the arc to b
+    core::Vec3 cp = a * cosBp + orthogonalize(c, a) * sinBp;
+
+    float cosTheta = 1 - u2 * (1 - cp.dot(b));
+    float sinTheta = sqrtf(std::max(0.f, 1 - cosTheta * cosTheta));
+    core::Vec3 w = b * cosTheta + orthogonalize(cp, b) * sinTheta;
+
+    *n = (v1 - v0).cross(v2 - v0).normalized();
+
+    // the point where the direction meets the triangle
+    float dist = (v0 - ps).dot(*n) / w.dot(*n);
+    *p = ps + w * dist;
+}
+
+float Mesh::pdf(const core::Vec3 &ps, int primID, const core::Vec3 &p, const core::Vec3 &n) const
+{
+    float solidAngle = sphericalSamplingSolidAngle(ps, triangles_[primID]);
+    if (solidAngle == 0)
+        return core::Shape::pdf(ps, primID, p, n);
+
+    return triangleTable_.pdf(primID) / solidAngle;
+}
+
 }		// shape
 }		// paprika
@@ -3,6 +3,7 @@
 
 #include <core/shape.hpp>
 #include <core/parametermap.hpp>
+#include <core/aliastable.hpp>
 
 namespace paprika {
 namespace shape {
@@ -15,16 +16,32 @@ public:
 
     virtual float area() const;
 
-    virtual void fillHitInfo(const core::Ray &ray, int primID, core::HitInfo *hitInfo) const;
+    virtual core::BBox bounds(const core::Transform &objectToWorld) const;
+
+    virtual void normalCone(const core::Transform &objectToWorld, core::Vec3 *axis, float *cosTheta) const;
+
+    virtual void fillHitInfo(const core::Ray &ray, const core::RayHit &hit, bool derivatives, core::HitInfo *hitInfo) const;
+    virtual void intersectPrim(const core::Ray &ray, int primID, core::RayHit *hit) const;
 
     virtual void fillInterpolationInfo(const core::HitInfo &hitInfo, core::InterpolationInfo *interp) const;
 
     virtual void sample(float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const;
+    virtual float pdf(int primID, const core::Vec3 &p) const;
+
+    virtual void sample(const core::Vec3 &ps, float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const;
+    virtual float pdf(const core::Vec3 &ps, int primID, const core::Vec3 &p, const core::Vec3 &n) const;
+
+    virtual int primCount() const;
+    virtual void samplePrim(int primID, float u1, float u2, core::Vec3 *p, core::Vec3 *n) const;
+    virtual void setPrimWeights(const std::vector<float> &weights);
 
 private:
     std::vector<core::Vec3> P_;
     std::vector<std::vector<int> > faces_;
-    std::vector<float> pdf_;
+
+    // triangle areas and the distribution sample() picks triangles from
+    std::vector<float> areas_;
+    core::AliasTable triangleTable_;
 
     struct Triangle
     {
@@ -34,6 +51,10 @@ private:
     };
     std::vector<Triangle> triangles_;
 
+    // solid angle of the triangle seen from ps, if it is in the range where
+    // sampling the spherical triangle is accurate, zero otherwise
+    float sphericalSamplingSolidAngle(const core::Vec3 &ps, const Triangle &t) const;
+
     float area_;
 };
 
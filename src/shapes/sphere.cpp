@@ -1,13 +1,18 @@
 #include <shapes/sphere.hpp>
+#include <algorithm>
 
 namespace paprika {
 namespace shape {
 
 Sphere::Sphere(RTCDevice device, float radius, core::ParameterMap &map) : radius_(radius)
 {
-    // TODO: transfer parameters but not vertex
+    // a sphere is a single piece without vertices, only constant and
+    // per-piece parameters carry values
+    transferParameters(map, 1, 1, 0, 0);
 
-    scene_ = rtcDeviceNewScene(device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+    RTCAlgorithmFlags flags = rtcAlgorithmFlags(device);
+
+    scene_ = rtcDeviceNewScene(device, RTC_SCENE_STATIC, flags);
     geomID_ = rtcNewUserGeometry(scene_, 1);
 
     rtcSetUserData(scene_, geomID_, this);
@@ -15,6 +20,22 @@ Sphere::Sphere(RTCDevice device, float radius, core::ParameterMap &map) : radius
     rtcSetIntersectFunction(scene_, geomID_, intersect_s);
     rtcSetOccludedFunction(scene_, geomID_, occluded_s);
 
+    if (flags & RTC_INTERSECT4)
+    {
+        rtcSetIntersectFunction4(scene_, geomID_, intersectN_s<RTCRay4, 4>);
+        rtcSetOccludedFunction4(scene_, geomID_, occludedN_s<RTCRay4, 4>);
+    }
+    if (flags & RTC_INTERSECT8)
+    {
+        rtcSetIntersectFunction8(scene_, geomID_, intersectN_s<RTCRay8, 8>);
+        rtcSetOccludedFunction8(scene_, geomID_, occludedN_s<RTCRay8, 8>);
+    }
+    if (flags & RTC_INTERSECT16)
+    {
+        rtcSetIntersectFunction16(scene_, geomID_, intersectN_s<RTCRay16, 16>);
+        rtcSetOccludedFunction16(scene_, geomID_, occludedN_s<RTCRay16, 16>);
+    }
+
     rtcCommit(scene_);
 }
 
@@ -33,10 +54,9 @@ void Sphere::bounds(size_t item, RTCBounds &bounds_o)
     bounds_o.upper_z = radius_;
 }
 
-static bool intersectHelper(const RTCRay &ray, float radius, float *tnear, float *tfar)
+// returns the nearest intersection in [tnear, tfar], if there is one
+static bool intersectHelper(const core::Vec3 &o, const core::Vec3 &d, float radius, float tnear, float tfar, float *t)
 {
-    core::Vec3 o(ray.org[0], ray.org[1], ray.org[2]);
-    core::Vec3 d(ray.dir[0], ray.dir[1], ray.dir[2]);
     float A = d.dot(d);
     float B = 2 * d.dot(o);
     float C = o.dot(o) - radius * radius;
@@ -44,25 +64,28 @@ static bool intersectHelper(const RTCRay &ray, float radius, float *tnear, float
     if (det < 0)
         return false;
     det = sqrt(det);
-    *tnear = (-B - det) / (2.f * A);
-    *tfar = (-B + det) / (2.f * A);
+    float t0 = (-B - det) / (2.f * A);
+    float t1 = (-B + det) / (2.f * A);
+
+    if (!(t0 <= tfar && t1 >= tnear))
+        return false;
+
+    if (t0 < tnear && t1 > tfar)
+        return false;
+
+    *t = t0 < tnear ? t1 : t0;
     return true;
 }
 
 void Sphere::intersect(RTCRay &ray, size_t item)
 {
-    float tnear, tfar;
-    if (intersectHelper(ray, radius_, &tnear, &tfar) == false)
-        return;
-
-    if (!(tnear <= ray.tfar && tfar >= ray.tnear))
-        return;
+    core::Vec3 o(ray.org[0], ray.org[1], ray.org[2]);
+    core::Vec3 d(ray.dir[0], ray.dir[1], ray.dir[2]);
 
-    if (tnear < ray.tnear && tfar > ray.tfar)
+    float t;
+    if (intersectHelper(o, d, radius_, ray.tnear, ray.tfar, &t) == false)
         return;
 
-    float t = tnear < ray.tnear ? tfar : tnear;
-
     ray.tfar = t;
     ray.geomID = geomID_;
     ray.primID = item;
@@ -88,68 +111,137 @@ void Sphere::intersect(RTCRay &ray, size_t item)
 
 void Sphere::occluded(RTCRay &ray, size_t item)
 {
-    float tnear, tfar;
-    if (intersectHelper(ray, radius_, &tnear, &tfar) == false)
-        return;
-
-    if (!(tnear <= ray.tfar && tfar >= ray.tnear))
-        return;
+    core::Vec3 o(ray.org[0], ray.org[1], ray.org[2]);
+    core::Vec3 d(ray.dir[0], ray.dir[1], ray.dir[2]);
 
-    if (tnear < ray.tnear && tfar > ray.tfar)
+    float t;
+    if (intersectHelper(o, d, radius_, ray.tnear, ray.tfar, &t) == false)
         return;
 
     ray.geomID = 0;
 }
 
+// packets are intersected one active ray at a time
+template <typename RTCRayN, int N>
+void Sphere::intersectN(const int *valid, RTCRayN &ray, size_t item)
+{
+    for (int i = 0; i < N; ++i)
+    {
+        if (valid[i] == 0)
+            continue;
+
+        core::Vec3 o(ray.orgx[i], ray.orgy[i], ray.orgz[i]);
+        core::Vec3 d(ray.dirx[i], ray.diry[i], ray.dirz[i]);
+
+        float t;
+        if (intersectHelper(o, d, radius_, ray.tnear[i], ray.tfar[i], &t) == false)
+            continue;
+
+        ray.tfar[i] = t;
+        ray.geomID[i] = geomID_;
+        ray.primID[i] = item;
+    }
+}
+
+template <typename RTCRayN, int N>
+void Sphere::occludedN(const int *valid, RTCRayN &ray, size_t item)
+{
+    for (int i = 0; i < N; ++i)
+    {
+        if (valid[i] == 0)
+            continue;
+
+        core::Vec3 o(ray.orgx[i], ray.orgy[i], ray.orgz[i]);
+        core::Vec3 d(ray.dirx[i], ray.diry[i], ray.dirz[i]);
+
+        float t;
+        if (intersectHelper(o, d, radius_, ray.tnear[i], ray.tfar[i], &t) == false)
+            continue;
+
+        ray.geomID[i] = 0;
+    }
+}
+
 float Sphere::area() const
 {
     return 4 * F_PI * radius_ * radius_;
 }
 
-void Sphere::fillHitInfo(const core::Ray &ray, int primID, core::HitInfo *hitInfo) const
+core::BBox Sphere::bounds(const core::Transform &objectToWorld) const
 {
-    hitInfo->primID = primID;
+    core::BBox bounds;
+    for (int i = 0; i < 8; ++i)
+    {
+        core::Vec3 corner((i & 1) ? radius_ : -radius_,
+                          (i & 2) ? radius_ : -radius_,
+                          (i & 4) ? radius_ : -radius_);
+        bounds.extendBy(objectToWorld.transformPoint(corner));
+    }
+    return bounds;
+}
 
-    OSL::Dual2<float> A = OSL::dot(ray.d, ray.d);
-    OSL::Dual2<float> B = 2.f * OSL::dot(ray.d, ray.o);
-    OSL::Dual2<float> C = OSL::dot(ray.o, ray.o) - radius_ * radius_;
-    OSL::Dual2<float> det = (B * B) - (4.f * A * C);
-    if (det.val() < 0)
-        return;
-    det = sqrt(det);
-    OSL::Dual2<float> tnear = (-B - det) / (2.f * A);
-    OSL::Dual2<float> tfar = (-B + det) / (2.f * A);
+void Sphere::fillHitInfo(const core::Ray &ray, const core::RayHit &hit, bool derivatives, core::HitInfo *hitInfo) const
+{
+    hitInfo->primID = hit.primID;
 
-    hitInfo->t = tnear.val() < ray.tnear ? tfar : tnear;
+    // differentials of t from the offset rays hitting the tangent plane
+    core::Vec3 P = ray.point(hit.t);
+    float dn = ray.d.val().dot(P);
+    float dtdx = dn != 0 ? -(ray.o.dx() + ray.d.dx() * hit.t).dot(P) / dn : 0.f;
+    float dtdy = dn != 0 ? -(ray.o.dy() + ray.d.dy() * hit.t).dot(P) / dn : 0.f;
+    hitInfo->t = OSL::Dual2<float>(hit.t, dtdx, dtdy);
 
-    OSL::Dual2<core::Vec3> P = ray.point(hitInfo->t);
+    float theta = atan2f(P.y, P.x);
+    if (theta < 0)
+        theta += 2 * F_PI;
+    float phi = asinf(std::min(1.f, std::max(-1.f, P.z / radius_)));
 
-    OSL::Dual2<float> Px(P.val().x, P.dx().x, P.dy().x);
-    OSL::Dual2<float> Py(P.val().y, P.dx().y, P.dy().y);
-    OSL::Dual2<float> Pz(P.val().z, P.dx().z, P.dy().z);
+    hitInfo->u = OSL::Dual2<float>(theta * (0.5f * F_INV_PI), 0.f, 0.f);
+    hitInfo->v = OSL::Dual2<float>((phi + (F_PI * 0.5f)) * F_INV_PI, 0.f, 0.f);
 
-    OSL::Dual2<float> theta = OSL::atan2(Py, Px);
-    if (theta.val() < 0)
-        theta += 2 * F_PI;
-    hitInfo->u = theta * (0.5f * F_INV_PI);
+    if (derivatives)
+    {
+        OSL::Dual2<core::Vec3> dP = ray.point(hitInfo->t);
+
+        OSL::Dual2<float> Px(dP.val().x, dP.dx().x, dP.dy().x);
+        OSL::Dual2<float> Py(dP.val().y, dP.dx().y, dP.dy().y);
+        OSL::Dual2<float> Pz(dP.val().z, dP.dx().z, dP.dy().z);
+
+        OSL::Dual2<float> dtheta = OSL::atan2(Py, Px);
+        if (dtheta.val() < 0)
+            dtheta += 2 * F_PI;
+        hitInfo->u = dtheta * (0.5f * F_INV_PI);
 
-    OSL::Dual2<float> phi = OSL::safe_asin(Pz / radius_);
-    hitInfo->v = (phi + (F_PI * 0.5f)) * F_INV_PI;
+        OSL::Dual2<float> dphi = OSL::safe_asin(Pz / radius_);
+        hitInfo->v = (dphi + (F_PI * 0.5f)) * F_INV_PI;
+    }
 
-    hitInfo->Ng = P.val().normalized();
+    hitInfo->Ng = P.normalized();
+
+    float cosTheta = cos(theta);
+    float sinTheta = sin(theta);
+    float cosPhi = cos(phi);
+    hitInfo->dPdu = core::Vec3(-P.y, P.x, 0) * (2 * F_PI);
+    hitInfo->dPdv = core::Vec3(-P.z * cosTheta, -P.z * sinTheta, radius_ * cosPhi) * F_PI;
+}
+
+void Sphere::intersectPrim(const core::Ray &ray, int primID, core::RayHit *hit) const
+{
+    hit->primID = primID;
+    hit->t = 0.f;
+    hit->u = 0.f;
+    hit->v = 0.f;
+
+    float t;
+    if (intersectHelper(ray.o.val(), ray.d.val(), radius_, ray.tnear, ray.tfar, &t))
+        hit->t = t;
 
-    float x = P.val().x;
-    float y = P.val().y;
-    float z = P.val().z;
-    float cosTheta = cos(theta.val());
-    float sinTheta = sin(theta.val());
-    float cosPhi = cos(phi.val());
-    hitInfo->dPdu = core::Vec3(-y, x, 0) * (2 * F_PI);
-    hitInfo->dPdv = core::Vec3(-z * cosTheta, -z * sinTheta, radius_ * cosPhi) * F_PI;
 }
 
 void Sphere::fillInterpolationInfo(const core::HitInfo &hitInfo, core::InterpolationInfo *interp) const
 {
+    interp->ipiece = 0;
+    interp->nweights = 0;
     interp->shape = this;
 }
 
@@ -166,5 +258,69 @@ void Sphere::sample(float u1, float u2, float u3, int *primID, core::Vec3 *p, co
     *n = core::Vec3(x, y, z);
 }
 
+float Sphere::oneMinusCosThetaMax(const core::Vec3 &ps) const
+{
+    float dc2 = ps.length2();
+    float r2 = radius_ * radius_;
+
+    if (dc2 <= r2)
+        return 0.f;
+
+    // for distant spheres 1 - cos is found from the taylor expansion, the
+    // subtraction would lose all precision
+    float sin2ThetaMax = r2 / dc2;
+    if (sin2ThetaMax < 0.00068523f)     // sin^2(1.5 deg)
+        return 0.5f * sin2ThetaMax;
+
+    return 1 - sqrtf(1 - sin2ThetaMax);
+}
+
+void Sphere::sample(const core::Vec3 &ps, float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const
+{
+    float oneMinusCosMax = oneMinusCosThetaMax(ps);
+
+    // points inside see the whole sphere
+    if (oneMinusCosMax == 0)
+    {
+        sample(u1, u2, u3, primID, p, n);
+        return;
+    }
+
+    // uniformly sample a direction in the cone around the center
+    float dc = ps.length();
+    float r2 = radius_ * radius_;
+
+    float oneMinusCosTheta = u1 * oneMinusCosMax;
+    float cosTheta = 1 - oneMinusCosTheta;
+    float sin2Theta = oneMinusCosTheta * (2 - oneMinusCosTheta);
+    float phi = 2 * F_PI * u2;
+
+    // angle at the center between the direction to ps and the point where
+    // the sampled direction first meets the sphere
+    float ds = dc * cosTheta - sqrtf(std::max(0.f, r2 - dc * dc * sin2Theta));
+    float cosAlpha = (dc * dc + r2 - ds * ds) / (2 * dc * radius_);
+    cosAlpha = std::min(1.f, std::max(-1.f, cosAlpha));
+    float sinAlpha = sqrtf(std::max(0.f, 1 - cosAlpha * cosAlpha));
+
+    core::Vec3 wc = ps / dc;
+    core::Vec3 wcX = fabsf(wc.x) > fabsf(wc.y) ? core::Vec3(-wc.z, 0, wc.x) : core::Vec3(0, wc.z, -wc.y);
+    wcX.normalize();
+    core::Vec3 wcY = wc.cross(wcX);
+
+    *primID = 0;
+    *n = (wcX * cosf(phi) + wcY * sinf(phi)) * sinAlpha + wc * cosAlpha;
+    *p = *n * radius_;
+}
+
+float Sphere::pdf(const core::Vec3 &ps, int primID, const core::Vec3 &p, const core::Vec3 &n) const
+{
+    float oneMinusCosMax = oneMinusCosThetaMax(ps);
+
+    if (oneMinusCosMax == 0)
+        return core::Shape::pdf(ps, primID, p, n);
+
+    return 1.f / (2 * F_PI * oneMinusCosMax);
+}
+
 }		// shape
 }		// paprika
@@ -14,15 +14,25 @@ public:
 
     virtual float area() const;
 
-    virtual void fillHitInfo(const core::Ray &ray, int primID, core::HitInfo *hitInfo) const;
+    virtual core::BBox bounds(const core::Transform &objectToWorld) const;
+
+    virtual void fillHitInfo(const core::Ray &ray, const core::RayHit &hit, bool derivatives, core::HitInfo *hitInfo) const;
+    virtual void intersectPrim(const core::Ray &ray, int primID, core::RayHit *hit) const;
 
     virtual void fillInterpolationInfo(const core::HitInfo &hitInfo, core::InterpolationInfo *interp) const;
 
     virtual void sample(float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const;
 
+    virtual void sample(const core::Vec3 &ps, float u1, float u2, float u3, int *primID, core::Vec3 *p, core::Vec3 *n) const;
+    virtual float pdf(const core::Vec3 &ps, int primID, const core::Vec3 &p, const core::Vec3 &n) const;
+
 private:
     float radius_;
 
+    // 1 - cos of the half angle of the cone of directions from ps to the
+    // sphere, zero if ps is inside
+    float oneMinusCosThetaMax(const core::Vec3 &ps) const;
+
 private:
     static void bounds_s(void *that, size_t item, RTCBounds &bounds_o)
     {
@@ -36,10 +46,24 @@ private:
     {
         static_cast<Sphere*>(that)->occluded(ray, item);
     }
+    template <typename RTCRayN, int N>
+    static void intersectN_s(const void *valid, void *that, RTCRayN &ray, size_t item)
+    {
+        static_cast<Sphere*>(that)->intersectN<RTCRayN, N>(static_cast<const int*>(valid), ray, item);
+    }
+    template <typename RTCRayN, int N>
+    static void occludedN_s(const void *valid, void *that, RTCRayN &ray, size_t item)
+    {
+        static_cast<Sphere*>(that)->occludedN<RTCRayN, N>(static_cast<const int*>(valid), ray, item);
+    }
 
     void bounds(size_t item, RTCBounds &bounds_o);
     void intersect(RTCRay &ray, size_t item);
     void occluded(RTCRay &ray, size_t item);
+    template <typename RTCRayN, int N>
+    void intersectN(const int *valid, RTCRayN &ray, size_t item);
+    template <typename RTCRayN, int N>
+    void occludedN(const int *valid, RTCRayN &ray, size_t item);
 };
 
 }		// shape
@@ -0,0 +1,49 @@
+-- A small Cornell box for the allocation test. The renderer exits with an
+-- error if tracing samples allocates from the heap after the first tile of
+-- each thread.
+
+local function matte(r, g, b)
+    shaderGroupBegin()
+    parameter("color Cs", {r, g, b})
+    shader("surface", "matte", "layer1")
+    shaderGroupEnd()
+end
+
+local function emitter(r, g, b, power)
+    shaderGroupBegin()
+    parameter("color Cs", {r, g, b})
+    parameter("float power", power)
+    shader("surface", "emitter", "layer1")
+    shaderGroupEnd()
+end
+
+local function quad(x0, y0, z0, x1, y1, z1, x2, y2, z2, x3, y3, z3, emissive)
+    parameter("vertex point P", {x0, y0, z0, x1, y1, z1, x2, y2, z2, x3, y3, z3})
+    parameter("int emissive", emissive or 0)
+    mesh("linear", {4}, {0, 1, 2, 3})
+end
+
+lookAt(278, 273, -800, 278, 273, -799, 0, 1, 0)
+
+camera("perspective", "int[2] resolution", {64, 64}, "float fov", 39.3077)
+
+world()
+
+matte(0.75, 0.25, 0.25)
+quad(552.8, 0, 0, 549.6, 0, 559.2, 556, 548.8, 559.2, 556, 548.8, 0)       -- green wall
+
+matte(0.25, 0.75, 0.25)
+quad(0, 0, 559.2, 0, 0, 0, 0, 548.8, 0, 0, 548.8, 559.2)                   -- red wall
+
+matte(0.75, 0.75, 0.75)
+quad(552.8, 0, 0, 0, 0, 0, 0, 0, 559.2, 549.6, 0, 559.2)                   -- floor
+quad(556, 548.8, 0, 556, 548.8, 559.2, 0, 548.8, 559.2, 0, 548.8, 0)       -- ceiling
+quad(549.6, 0, 559.2, 0, 0, 559.2, 0, 548.8, 559.2, 556, 548.8, 559.2)     -- back
+
+emitter(1.0, 0.8, 0.6, 2500000)
+quad(343, 548.3, 227, 343, 548.3, 332, 213, 548.3, 332, 213, 548.3, 227, 1)
+
+-- several tiles per thread and more than one adaptive pass
+render("int threads", 2, "int tilesize", 16,
+       "float noisethreshold", 0.05, "int minsamples", 4, "int maxsamples", 16,
+       "int texturestats", 0)
@@ -0,0 +1,36 @@
+-- Two quads sharing a shader group whose int parameter "index" is userdata.
+-- The left quad keeps the group's value, the right one overrides it, so the
+-- image is red on the left and green on the right. Binding the parameter
+-- must not report any error.
+
+local function quad(x0, y0, z0, x1, y1, z1, x2, y2, z2, x3, y3, z3, emissive)
+    parameter("vertex point P", {x0, y0, z0, x1, y1, z1, x2, y2, z2, x3, y3, z3})
+    parameter("int emissive", emissive or 0)
+    mesh("linear", {4}, {0, 1, 2, 3})
+end
+
+lookAt(0, 0, -5, 0, 0, 0, 0, 1, 0)
+
+camera("perspective", "int[2] resolution", {32, 16}, "float fov", 60)
+
+world()
+
+shaderGroupBegin()
+parameter("int index", 0)
+parameter("string userdata", "index")
+shader("surface", "indexed", "layer1")
+shaderGroupEnd()
+
+quad(-2, -1, 0, -2, 1, 0, 0, 1, 0, 0, -1, 0)
+
+parameter("int index", 1)
+quad(0, -1, 0, 0, 1, 0, 2, 1, 0, 2, -1, 0)
+
+shaderGroupBegin()
+parameter("float power", 100)
+shader("surface", "emitter", "layer1")
+shaderGroupEnd()
+
+quad(-2, 1, -4, 2, 1, -4, 2, 1, 0, -2, 1, 0, 1)
+
+render("int samples", 4, "int texturestats", 0)